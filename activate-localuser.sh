@@ -24,7 +24,7 @@ esac
 if ${activate}; then
   sedcmd='/^hosts:/s/hosts:[ \t]*/&localuser /'
 else
-  sedcmd='/^hosts:/s/localuser *//'
+  sedcmd='/^hosts:/s/localuser *\(\[[^]]*\] *\)\?//'
 fi
 if ! cp "${file}" "${file}~"; then
   echo "Can't save file ${file} to ${file}~" >&2
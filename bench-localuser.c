@@ -0,0 +1,630 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * bench-localuser.c
+ * -----------------
+ *  Measures the time taken by resolutions.
+ *
+ *  usage: bench-localuser command [-n count] [-4|-6] [-l lib] [-s len] name...
+ *
+ *  commands:
+ *    getaddrinfo    resolution through NSS using getaddrinfo
+ *    gethostbyname  direct calls to gethostbyname2_r of the module
+ *    miss           direct calls to gethostbyname2_r of the module for
+ *                   names that aren't localuser names, all the names
+ *                   are resolved in turn
+ *    parse          internal parser of numbers (arguments are numbers)
+ *    reverse        internal reverse resolution of every address of the
+ *                   ranges given as arguments: uid, appid or both
+ *    registry       internal lookup of names of applications in the
+ *                   registry (arguments are names)
+ *    classify       classification by localuser_classify_ipv4s of count
+ *                   random addresses of the ranges given as arguments:
+ *                   uid, appid, both, large, replica, loopback or any,
+ *                   with each classifier, against decode_ipv4. The rate
+ *                   is the one of a single core
+ *    batch          batch resolution by localuser_resolve_names of count
+ *                   names, the arguments in turn, with each matcher of
+ *                   prefixes, against gethostbyname2_r of the module
+ *    connect        connections to a server of the loopback, for each
+ *                   argument: plain (connect), localuser (localuser_connect)
+ *                   or an APPID (localuser_connect_app). The connections
+ *                   are kept open, the count of connections done before
+ *                   the first failure, usually EADDRNOTAVAIL, is reported
+ *
+ *  options:
+ *    -n count  count of calls per name (default 100000)
+ *    -4, -6    family to query (default AF_UNSPEC)
+ *    -l lib    path of the module (default ./libnss_localuser.so.2)
+ *    -s len    install first a seccomp filter of len tests on syscall
+ *              arguments, as done by sandboxed services
+ *
+ *  For getaddrinfo, the module must be installed and activated (or found
+ *  through LD_LIBRARY_PATH) for the names to be resolved by localuser.
+ *  Running the same command against two builds of the module compares them.
+ *
+ *  The internal functions are measured by including localuser.c.
+ */
+#include "localuser.c"
+#include "liblocaluser.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <netdb.h>
+#include <nss.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+typedef enum nss_status gethostbyname2_r_t(const char *, int,
+		struct hostent *, char *, size_t, int *, int *);
+
+/* keeps the results of measured functions */
+static volatile uint32_t sink;
+
+/* current monotonic time in nanoseconds */
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* print the result of a measure */
+static void report(const char *what, const char *arg, unsigned long count, uint64_t ns)
+{
+	printf("%-14s %-24s %10lu calls %10.1f ns/call %12.0f calls/s\n",
+		what, arg, count, (double)ns / (double)count,
+		ns ? 1e9 * (double)count / (double)ns : 0.0);
+}
+
+/* measure getaddrinfo */
+static int bench_getaddrinfo(unsigned long count, int family, char **names)
+{
+	struct addrinfo hints, *res;
+	unsigned long i;
+	uint64_t t0;
+	int rc;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+
+	for ( ; *names ; names++) {
+		rc = getaddrinfo(*names, NULL, &hints, &res);
+		if (rc) {
+			fprintf(stderr, "can't resolve %s: %s\n", *names, gai_strerror(rc));
+			return 1;
+		}
+		freeaddrinfo(res);
+		t0 = now();
+		for (i = 0 ; i < count ; i++) {
+			getaddrinfo(*names, NULL, &hints, &res);
+			freeaddrinfo(res);
+		}
+		report("getaddrinfo", *names, count, now() - t0);
+	}
+	return 0;
+}
+
+/* measure direct calls to gethostbyname2_r of the module */
+static int bench_gethostbyname(unsigned long count, int family, const char *lib, char **names)
+{
+	void *handle;
+	gethostbyname2_r_t *fun;
+	struct hostent he;
+	char buffer[1024];
+	unsigned long i;
+	uint64_t t0;
+	int err, herr;
+
+	handle = dlopen(lib, RTLD_NOW);
+	fun = handle ? (gethostbyname2_r_t*)dlsym(handle, "_nss_localuser_gethostbyname2_r") : NULL;
+	if (!fun) {
+		fprintf(stderr, "can't load %s: %s\n", lib, dlerror());
+		return 1;
+	}
+	for ( ; *names ; names++) {
+		if (fun(*names, family, &he, buffer, sizeof buffer, &err, &herr) != NSS_STATUS_SUCCESS)
+			fprintf(stderr, "warning, %s isn't resolved\n", *names);
+		t0 = now();
+		for (i = 0 ; i < count ; i++)
+			fun(*names, family, &he, buffer, sizeof buffer, &err, &herr);
+		report("gethostbyname", *names, count, now() - t0);
+	}
+	return 0;
+}
+
+/*
+ * measure the cost of the module for names that aren't for it, as when
+ * localuser is first on the hosts line. The result is the time added to
+ * each resolution. Running the command getaddrinfo with and without
+ * localuser on the hosts line gives the overhead through NSS.
+ */
+static int bench_miss(unsigned long count, int family, const char *lib, char **names)
+{
+	void *handle;
+	gethostbyname2_r_t *fun;
+	struct hostent he;
+	char buffer[1024];
+	unsigned long i, n;
+	uint64_t t0;
+	int err, herr;
+
+	handle = dlopen(lib, RTLD_NOW);
+	fun = handle ? (gethostbyname2_r_t*)dlsym(handle, "_nss_localuser_gethostbyname2_r") : NULL;
+	if (!fun) {
+		fprintf(stderr, "can't load %s: %s\n", lib, dlerror());
+		return 1;
+	}
+	for (n = 0 ; names[n] ; n++)
+		if (fun(names[n], family, &he, buffer, sizeof buffer, &err, &herr) != NSS_STATUS_NOTFOUND)
+			fprintf(stderr, "warning, %s is resolved\n", names[n]);
+	t0 = now();
+	for (i = 0 ; i < count ; i++)
+		fun(names[i % n], family, &he, buffer, sizeof buffer, &err, &herr);
+	report("miss", names[0], count, now() - t0);
+	return 0;
+}
+
+/*
+ * measure the batch resolution of count names, copies of the given
+ * names in turn, against direct calls to gethostbyname2_r of the module
+ * for each name
+ */
+static int bench_batch(unsigned long count, const char *lib, char **names)
+{
+	static unsigned (*const matchers[])(const char *const *) = {
+		match_prefixes_scalar,
+#if defined __x86_64__ || defined __i386__
+		match_prefixes_sse2,
+#endif
+#if defined __x86_64__
+		match_prefixes_avx2,
+#endif
+	};
+	static const char *const matcher_names[] = { "scalar", "sse2", "avx2" };
+	void *handle;
+	gethostbyname2_r_t *fun;
+	struct hostent he;
+	char buffer[1024], *arena, *iter;
+	const char **list;
+	uint32_t *addrs;
+	int *status;
+	unsigned long i, n, size;
+	unsigned m;
+	uint64_t t0;
+	int err, herr;
+
+	handle = dlopen(lib, RTLD_NOW);
+	fun = handle ? (gethostbyname2_r_t*)dlsym(handle, "_nss_localuser_gethostbyname2_r") : NULL;
+	if (!fun) {
+		fprintf(stderr, "can't load %s: %s\n", lib, dlerror());
+		return 1;
+	}
+
+	/* copy the names in turn */
+	for (n = size = 0 ; names[n] ; n++)
+		size += strlen(names[n]) + 1;
+	arena = malloc((count / n + 1) * size);
+	list = malloc(count * sizeof *list);
+	addrs = malloc(count * sizeof *addrs);
+	status = malloc(count * sizeof *status);
+	if (!arena || !list || !addrs || !status) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0, iter = arena ; i < count ; i++) {
+		list[i] = iter;
+		iter = stpcpy(iter, names[i % n]) + 1;
+	}
+
+	t0 = now();
+	for (i = 0 ; i < count ; i++)
+		sink = fun(list[i], AF_INET, &he, buffer, sizeof buffer, &err, &herr);
+	report("gethostbyname", "per name", count, now() - t0);
+
+	pthread_once(&match_once, select_match_prefixes);
+	for (m = 0 ; m < sizeof matchers / sizeof *matchers ; m++) {
+#if defined __x86_64__
+		if (matchers[m] == match_prefixes_avx2 && !__builtin_cpu_supports("avx2"))
+			continue;
+#endif
+		match_prefixes = matchers[m];
+		t0 = now();
+		sink = (uint32_t)localuser_resolve_names(list, count, addrs, status);
+		report("batch", matcher_names[m], count, now() - t0);
+	}
+
+	free(arena);
+	free(list);
+	free(addrs);
+	free(status);
+	return 0;
+}
+
+/*
+ * measure the classification by localuser_classify_ipv4s of count
+ * random addresses of the ranges given, with each classifier, against
+ * decode_ipv4 for each address
+ */
+static int bench_classify(unsigned long count, char **ranges)
+{
+	static size_t (*const classifiers[])(const uint32_t *, size_t, uint32_t *,
+					     uint32_t *, uint8_t *, size_t *) = {
+		NULL,
+#if defined __x86_64__ || defined __i386__
+		classify_sse41,
+		classify_avx2,
+#endif
+	};
+	static const char *const classifier_names[] = { "scalar", "sse4.1", "avx2" };
+	uint32_t prefixes[16], masks[16], *addrs, *uids, *appids, seed = 1;
+	uint8_t *kinds;
+	struct lud lud;
+	unsigned long i;
+	unsigned c, n;
+	uint64_t t0;
+
+	for (n = 0 ; ranges[n] ; n++) {
+		if (n == 16) {
+			fprintf(stderr, "too many ranges\n");
+			return 1;
+		}
+		if (!strcmp(ranges[n], "uid")) {
+			prefixes[n] = locusr_uid_only_prefix;
+			masks[n] = locusr_uid_only_mask;
+		} else if (!strcmp(ranges[n], "appid")) {
+			prefixes[n] = locusr_appid_only_prefix;
+			masks[n] = locusr_appid_only_mask;
+		} else if (!strcmp(ranges[n], "both")) {
+			prefixes[n] = locusr_both_ids_prefix;
+			masks[n] = locusr_both_ids_mask;
+		} else if (!strcmp(ranges[n], "large")) {
+			prefixes[n] = locusr_large_uid_prefix;
+			masks[n] = locusr_large_uid_mask;
+		} else if (!strcmp(ranges[n], "replica")) {
+			prefixes[n] = locusr_replica_prefix;
+			masks[n] = locusr_replica_mask;
+		} else if (!strcmp(ranges[n], "loopback")) {
+			prefixes[n] = 0x7f000000;
+			masks[n] = 0xff000000;
+		} else if (!strcmp(ranges[n], "any")) {
+			prefixes[n] = 0;
+			masks[n] = 0;
+		} else {
+			fprintf(stderr, "unknown range %s\n", ranges[n]);
+			return 1;
+		}
+	}
+
+	addrs = malloc(count * sizeof *addrs);
+	uids = malloc(count * sizeof *uids);
+	appids = malloc(count * sizeof *appids);
+	kinds = malloc(count * sizeof *kinds);
+	if (!addrs || !uids || !appids || !kinds) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0 ; i < count ; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		addrs[i] = htonl(prefixes[i % n] | (seed & ~masks[i % n]));
+	}
+
+	t0 = now();
+	for (i = 0 ; i < count ; i++)
+		sink = (uint32_t)decode_ipv4(addrs[i], &lud);
+	report("decode_ipv4", "per address", count, now() - t0);
+
+	pthread_once(&classify_once, select_classify);
+	for (c = 0 ; c < sizeof classifiers / sizeof *classifiers ; c++) {
+#if defined __x86_64__ || defined __i386__
+		if ((classifiers[c] == classify_avx2 && !__builtin_cpu_supports("avx2"))
+		 || (classifiers[c] == classify_sse41 && !__builtin_cpu_supports("sse4.1")))
+			continue;
+#endif
+		classify = classifiers[c];
+		t0 = now();
+		sink = (uint32_t)localuser_classify_ipv4s(addrs, count, uids, appids, kinds);
+		report("classify", classifier_names[c], count, now() - t0);
+	}
+
+	free(addrs);
+	free(uids);
+	free(appids);
+	free(kinds);
+	return 0;
+}
+
+/* measure the internal parser of numbers */
+static int bench_parse(unsigned long count, char **numbers)
+{
+	unsigned long i;
+	uint64_t t0;
+	uint32_t val;
+	int len;
+
+	for ( ; *numbers ; numbers++) {
+		len = (int)strlen(*numbers);
+		if (read_u32(*numbers, &val) != len)
+			fprintf(stderr, "warning, %s isn't valid\n", *numbers);
+		t0 = now();
+		for (i = 0 ; i < count ; i++) {
+			read_u32(*(char *volatile*)numbers, &val);
+			sink = val;
+		}
+		report("parse", *numbers, count, now() - t0);
+	}
+	return 0;
+}
+
+/*
+ * measure the internal reverse resolution, from the address to the
+ * hostent, for all the addresses of the ranges of the given names
+ */
+static int bench_reverse(char **ranges)
+{
+	struct lud lud;
+	struct hostent he;
+	char buffer[1024];
+	uint32_t prefix, mask, adr;
+	unsigned long count;
+	uint64_t t0;
+	int err, herr;
+
+	for ( ; *ranges ; ranges++) {
+		if (!strcmp(*ranges, "uid")) {
+			prefix = locusr_uid_only_prefix;
+			mask = locusr_uid_only_mask;
+		} else if (!strcmp(*ranges, "appid")) {
+			prefix = locusr_appid_only_prefix;
+			mask = locusr_appid_only_mask;
+		} else if (!strcmp(*ranges, "both")) {
+			prefix = locusr_both_ids_prefix;
+			mask = locusr_both_ids_mask;
+		} else {
+			fprintf(stderr, "unknown range %s\n", *ranges);
+			return 1;
+		}
+		count = 0;
+		t0 = now();
+		for (adr = prefix ; (adr & mask) == prefix ; adr++, count++) {
+			decode_ipv4(htonl(adr), &lud);
+			fillent(&lud, AF_INET, &he, buffer, sizeof buffer, &err, &herr);
+			sink = (uint32_t)he.h_name[lud.len - 1];
+		}
+		report("reverse", *ranges, count, now() - t0);
+	}
+	return 0;
+}
+
+/* measure the internal lookup of names of applications */
+static int bench_registry(unsigned long count, char **names)
+{
+	unsigned long i;
+	uint64_t t0;
+	uint32_t val;
+	int len;
+
+	for ( ; *names ; names++) {
+		len = (int)strlen(*names);
+		if (read_appname(*names, &val) != len)
+			fprintf(stderr, "warning, %s isn't registered\n", *names);
+		t0 = now();
+		for (i = 0 ; i < count ; i++) {
+			read_appname(*(char *volatile*)names, &val);
+			sink = val;
+		}
+		report("registry", *names, count, now() - t0);
+	}
+	return 0;
+}
+
+/* accept the connections and close them */
+static void *acceptor(void *arg)
+{
+	int srv = *(int*)arg, fd;
+
+	for (;;) {
+		fd = accept(srv, NULL, NULL);
+		if (fd >= 0)
+			close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * measure the connections to a server of the loopback. The connections
+ * are kept open until count connections are done or one fails, so that
+ * the count of connections reported for a failure is the count of
+ * simultaneous connections possible.
+ */
+static int bench_connect(unsigned long count, char **modes)
+{
+	struct sockaddr_in sin;
+	struct rlimit rlim;
+	socklen_t len;
+	pthread_t tid;
+	unsigned long i, j;
+	uint64_t t0;
+	uint32_t appid;
+	int srv, rc, err, *fds;
+
+	/* enough file descriptors are needed */
+	rlim.rlim_cur = rlim.rlim_max = count + 100;
+	if (setrlimit(RLIMIT_NOFILE, &rlim) && (getrlimit(RLIMIT_NOFILE, &rlim)
+	 || (rlim.rlim_cur = rlim.rlim_max, setrlimit(RLIMIT_NOFILE, &rlim))))
+		fprintf(stderr, "warning, can't set the limit of files: %s\n", strerror(errno));
+	fds = calloc(count, sizeof *fds);
+	if (!fds)
+		return 1;
+
+	/* start the server */
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001u);
+	len = sizeof sin;
+	srv = socket(AF_INET, SOCK_STREAM, 0);
+	if (srv < 0 || bind(srv, (struct sockaddr*)&sin, len) || listen(srv, 4096)
+	 || getsockname(srv, (struct sockaddr*)&sin, &len)
+	 || pthread_create(&tid, NULL, acceptor, &srv)) {
+		fprintf(stderr, "can't start server: %s\n", strerror(errno));
+		return 1;
+	}
+
+	for ( ; *modes ; modes++) {
+		appid = (uint32_t)strtoul(*modes, NULL, 10);
+		err = 0;
+		t0 = now();
+		for (i = 0 ; i < count ; i++) {
+			fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+			if (fds[i] < 0) {
+				err = errno;
+				break;
+			}
+			if (!strcmp(*modes, "plain"))
+				rc = connect(fds[i], (struct sockaddr*)&sin, len);
+			else if (!strcmp(*modes, "localuser"))
+				rc = localuser_connect(fds[i], (struct sockaddr*)&sin, len);
+			else
+				rc = localuser_connect_app(fds[i], (struct sockaddr*)&sin, len, appid);
+			if (rc < 0) {
+				err = errno;
+				close(fds[i]);
+				break;
+			}
+		}
+		report("connect", *modes, i, now() - t0);
+		if (err)
+			printf("%-14s %-24s failed after %lu connections: %s\n",
+				"connect", *modes, i, strerror(err));
+		for (j = 0 ; j < i ; j++)
+			close(fds[j]);
+	}
+	free(fds);
+	return 0;
+}
+
+/*
+ * Install a seccomp filter of len tests on the first argument of the
+ * syscall. Testing arguments prevents the kernel from caching the
+ * decision per syscall number, so each syscall runs the whole filter.
+ */
+static int install_seccomp(unsigned len)
+{
+	struct sock_filter *insns;
+	struct sock_fprog prog;
+	unsigned i, n;
+
+	n = 2 * len + 1;
+	insns = calloc(n, sizeof *insns);
+	if (!insns)
+		return -1;
+	for (i = 0 ; i < len ; i++) {
+		insns[2 * i] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+				(uint32_t)offsetof(struct seccomp_data, args[0]));
+		insns[2 * i + 1] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+				0xdead0000u + i, 0, 0);
+	}
+	insns[n - 1] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+	prog.len = (unsigned short)n;
+	prog.filter = insns;
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)
+	 || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0)) {
+		free(insns);
+		return -1;
+	}
+	free(insns);
+	return 0;
+}
+
+static int usage(void)
+{
+	fprintf(stderr, "usage: bench-localuser command [-n count] [-4|-6] [-l lib] [-s len] name...\n"
+			"commands: getaddrinfo gethostbyname miss parse reverse registry batch classify connect\n");
+	return 1;
+}
+
+int main(int ac, char **av)
+{
+	unsigned long count = 100000;
+	int family = AF_UNSPEC;
+	const char *lib = "./libnss_localuser.so.2";
+	unsigned filter = 0;
+	int opt;
+
+	if (ac < 2)
+		return usage();
+
+	optind = 2;
+	while ((opt = getopt(ac, av, "n:46l:s:")) != -1) {
+		switch (opt) {
+		case 'n': count = strtoul(optarg, NULL, 10); break;
+		case '4': family = AF_INET; break;
+		case '6': family = AF_INET6; break;
+		case 'l': lib = optarg; break;
+		case 's': filter = (unsigned)strtoul(optarg, NULL, 10); break;
+		default: return usage();
+		}
+	}
+	if (!count || !av[optind] || filter > 1000)
+		return usage();
+
+	if (filter && install_seccomp(filter)) {
+		fprintf(stderr, "can't install seccomp filter: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (!strcmp(av[1], "getaddrinfo"))
+		return bench_getaddrinfo(count, family, &av[optind]);
+	if (!strcmp(av[1], "gethostbyname"))
+		return bench_gethostbyname(count, family, lib, &av[optind]);
+	if (!strcmp(av[1], "miss"))
+		return bench_miss(count, family, lib, &av[optind]);
+	if (!strcmp(av[1], "parse"))
+		return bench_parse(count, &av[optind]);
+	if (!strcmp(av[1], "reverse"))
+		return bench_reverse(&av[optind]);
+	if (!strcmp(av[1], "registry"))
+		return bench_registry(count, &av[optind]);
+	if (!strcmp(av[1], "classify"))
+		return bench_classify(count, &av[optind]);
+	if (!strcmp(av[1], "batch"))
+		return bench_batch(count, lib, &av[optind]);
+	if (!strcmp(av[1], "connect"))
+		return bench_connect(count, &av[optind]);
+	return usage();
+}
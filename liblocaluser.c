@@ -0,0 +1,786 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * liblocaluser.c
+ * --------------
+ *  Companion library of the NSS module localuser.
+ *
+ *  It provides the codec of the names and addresses of localuser and
+ *  helpers for connecting to the loopback from the localuser addresses
+ *  of the caller. The codec is the one of the module: localuser.c is
+ *  included without its NSS entries, so both never diverge.
+ *
+ *  By default, the kernel uses 127.0.0.1 as source address of the
+ *  connections to the loopback: all of them share the same pool of
+ *  ephemeral ports and the server can't tell who connects. Binding the
+ *  source to "localuser--APPID" and its replicas "localuser--APPID.N"
+ *  multiplies the usable 4-tuples and shows the identity to the server.
+ *
+ *  The tools including localuser.c, with its NSS entries, can include
+ *  this file after it.
+ */
+#ifndef LOCALUSER_C
+#define LOCALUSER_CODEC_ONLY
+#include "localuser.c"
+#endif
+
+#include <netinet/in.h>
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+#endif
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+/* count of source addresses: the one of the name and its 3 replicas */
+#define MAXSOURCES 4
+
+/* count of entries of the cache of source addresses */
+#define CACHESIZE 16
+
+/* the source addresses of an identity */
+struct sources
+{
+	unsigned valid: 1;	/* entry is valid */
+	unsigned has_appid: 1;	/* has a appid */
+	uint32_t uid;		/* the uid */
+	uint32_t appid;		/* appid if any */
+	unsigned count;		/* count of addresses */
+	uint32_t ipv4[MAXSOURCES]; /* the addresses in network order */
+};
+
+/* cache of the source addresses */
+static struct sources cache[CACHESIZE];
+static unsigned cache_next;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* counter for rotating the source addresses */
+static unsigned rotation;
+
+/* fill src with the source addresses of the identity */
+static void get_sources(int has_appid, uint32_t appid, struct sources *src)
+{
+	struct sources *iter;
+	struct localuser_id id;
+	uint32_t uid;
+	unsigned n;
+
+	uid = current_uid();
+	pthread_mutex_lock(&cache_mutex);
+	for (iter = cache ; iter < &cache[CACHESIZE] ; iter++) {
+		if (iter->valid && iter->uid == uid && iter->has_appid == has_appid
+		 && (!has_appid || iter->appid == appid)) {
+			*src = *iter;
+			pthread_mutex_unlock(&cache_mutex);
+			return;
+		}
+	}
+
+	/* encode the address and the ones of its replicas */
+	src->valid = 1;
+	src->uid = uid;
+	src->has_appid = has_appid & 1;
+	src->appid = appid;
+	src->count = 0;
+	id.flags = LOCALUSER_UID | (has_appid ? LOCALUSER_APPID : 0);
+	id.uid = uid;
+	id.appid = appid;
+	for (n = 0 ; n < (has_appid ? MAXSOURCES : 1) ; n++) {
+		id.replica = n;
+		if (localuser_encode_ipv4(&id, &src->ipv4[src->count]) == LOCALUSER_OK)
+			src->count++;
+		else if (!n)
+			break;
+	}
+	cache[cache_next] = *src;
+	cache_next = (cache_next + 1) % CACHESIZE;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/* get the IPv4 address of addr if it is one of the loopback, or 0 */
+static uint32_t loopback_ipv4(const struct sockaddr *addr, socklen_t addrlen)
+{
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+	uint32_t ipv4;
+
+	if (addr->sa_family == AF_INET && addrlen >= sizeof *sin) {
+		sin = (const struct sockaddr_in*)addr;
+		ipv4 = sin->sin_addr.s_addr;
+	} else if (addr->sa_family == AF_INET6 && addrlen >= sizeof *sin6) {
+		sin6 = (const struct sockaddr_in6*)addr;
+		if (!IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+			return 0;
+		memcpy(&ipv4, &sin6->sin6_addr.s6_addr[12], sizeof ipv4);
+	} else
+		return 0;
+	return (ntohl(ipv4) >> 24) == 127 ? ipv4 : 0;
+}
+
+/* bind sockfd of family to the IPv4 address ipv4 without choosing the port */
+static int bind_source(int sockfd, int family, uint32_t ipv4)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	int one = 1;
+
+	setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof one);
+	if (family == AF_INET) {
+		memset(&sin, 0, sizeof sin);
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = ipv4;
+		return bind(sockfd, (struct sockaddr*)&sin, sizeof sin);
+	}
+	memset(&sin6, 0, sizeof sin6);
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_addr.s6_addr[10] = 0xff;
+	sin6.sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&sin6.sin6_addr.s6_addr[12], &ipv4, sizeof ipv4);
+	return bind(sockfd, (struct sockaddr*)&sin6, sizeof sin6);
+}
+
+/* connect from the addresses of the identity */
+static int connect_from(int sockfd, const struct sockaddr *addr, socklen_t addrlen,
+			int has_appid, uint32_t appid)
+{
+	struct sources src;
+	unsigned n;
+
+	if (loopback_ipv4(addr, addrlen)) {
+		get_sources(has_appid, appid, &src);
+		if (src.count) {
+			n = __atomic_fetch_add(&rotation, 1, __ATOMIC_RELAXED) % src.count;
+			if (bind_source(sockfd, addr->sa_family, src.ipv4[n]) < 0
+			 && errno != EINVAL) /* EINVAL: already bound */
+				return -1;
+		}
+	}
+	return connect(sockfd, addr, addrlen);
+}
+
+/* connect from the address of the current user */
+int localuser_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	return connect_from(sockfd, addr, addrlen, 0, 0);
+}
+
+/* connect from the addresses of the application of the current user */
+int localuser_connect_app(int sockfd, const struct sockaddr *addr, socklen_t addrlen, uint32_t appid)
+{
+	return connect_from(sockfd, addr, addrlen, 1, appid);
+}
+
+/* set id from lud */
+static void id_of_lud(const struct lud *lud, struct localuser_id *id)
+{
+	id->flags = (lud->has_uid ? LOCALUSER_UID : 0) | (lud->has_appid ? LOCALUSER_APPID : 0);
+	id->uid = lud->has_uid ? lud->uid : 0;
+	id->appid = lud->has_appid ? lud->appid : 0;
+	id->replica = lud->replica;
+}
+
+/* set lud from id, returns 0 if id is invalid */
+static int lud_of_id(const struct localuser_id *id, struct lud *lud)
+{
+	if (!(id->flags & (LOCALUSER_UID | LOCALUSER_APPID))
+	 || id->replica > locusr_replica_max
+	 || (id->replica && id->flags != (LOCALUSER_UID | LOCALUSER_APPID)))
+		return 0;
+	lud->has_uid = !!(id->flags & LOCALUSER_UID);
+	lud->has_appid = !!(id->flags & LOCALUSER_APPID);
+	lud->uid = id->uid;
+	lud->appid = id->appid;
+	lud->replica = id->replica;
+	if (lud->has_uid)
+		lud->me = current_uid();
+	return 1;
+}
+
+/* parse the name */
+int localuser_parse_name(const char *name, struct localuser_id *id)
+{
+	struct lud lud;
+	int rc;
+
+	rc = decode_name(name, &lud);
+	if (rc == 1)
+		id_of_lud(&lud, id);
+	return rc;
+}
+
+/* write the canonical name of id */
+size_t localuser_format_name(const struct localuser_id *id, char *buffer, size_t size)
+{
+	struct lud lud;
+	char name[LOCALUSER_NAME_SIZE];
+
+	if (!lud_of_id(id, &lud))
+		return 0;
+	measure_name(&lud);
+	if (size > lud.len)
+		encode_name(&lud, buffer);
+	else if (size) {
+		encode_name(&lud, name);
+		memcpy(buffer, name, size - 1);
+		buffer[size - 1] = 0;
+	}
+	return lud.len;
+}
+
+/* kind of the IPv4 address */
+enum localuser_kind localuser_classify_ipv4(uint32_t addr)
+{
+	return classify_ipv4(ntohl(addr));
+}
+
+/* decode the IPv4 address */
+int localuser_decode_ipv4(uint32_t addr, struct localuser_id *id)
+{
+	struct lud lud;
+	int rc;
+
+	rc = decode_ipv4_ids(addr, &lud);
+	if (rc == 1)
+		id_of_lud(&lud, id);
+	return rc;
+}
+
+/* encode the IPv4 address */
+int localuser_encode_ipv4(const struct localuser_id *id, uint32_t *addr)
+{
+	struct lud lud;
+	int rc;
+
+	if (!lud_of_id(id, &lud))
+		return -1;
+	rc = encode_lud(&lud);
+	if (rc != 1 || !lud.has_ipv4)
+		return -2;
+	*addr = lud.ipv4;
+	return 1;
+}
+
+/* decode the IPv6 address */
+int localuser_decode_ipv6(const struct in6_addr *addr, struct localuser_id *id)
+{
+	struct lud lud;
+	uint32_t bufip[4];
+	int rc;
+
+	memcpy(bufip, addr, sizeof bufip);
+	if (bufip[0] == 0 && bufip[1] == 0 && bufip[2] == htonl(0xffff))
+		rc = decode_ipv4_ids(bufip[3], &lud);
+	else
+		rc = decode_ipv6_ids(bufip, &lud);
+	if (rc == 1)
+		id_of_lud(&lud, id);
+	return rc;
+}
+
+/* encode the IPv6 address */
+int localuser_encode_ipv6(const struct localuser_id *id, struct in6_addr *addr)
+{
+	struct lud lud;
+	uint32_t bufip[4];
+	int rc;
+
+	if (!lud_of_id(id, &lud))
+		return -1;
+	rc = encode_lud(&lud);
+	if (rc != 1)
+		return rc;
+	encode_ipv6(bufip, &lud);
+	memcpy(addr, bufip, sizeof bufip);
+	return 1;
+}
+
+/* count of names whose prefixes are matched together */
+#define BATCH 8
+
+/* count of the first bytes of the names matched */
+#define PREFIXLEN 16
+
+/*
+ * Copy in b the first PREFIXLEN bytes of name. They are read at once
+ * unless the page of name could end before, the bytes after the end of
+ * name being then zeros.
+ */
+static void prefix_bytes(const char *name, char b[PREFIXLEN])
+{
+	unsigned i;
+
+	if (((uintptr_t)name & 4095) <= 4096 - PREFIXLEN)
+		memcpy(b, name, PREFIXLEN);
+	else {
+		memset(b, 0, PREFIXLEN);
+		for (i = 0 ; i < PREFIXLEN && name[i] ; i++)
+			b[i] = name[i];
+	}
+}
+
+/* the word of "localuse", the first 8 bytes of "localuser" */
+static uint64_t prefix_pattern(void)
+{
+	uint64_t p;
+
+	memcpy(&p, localuser, sizeof p);
+	return p;
+}
+
+/*
+ * Test if the bytes b of a name start with "localuser" whatever the case
+ * followed by a dash, a dot or the end, the only names that can be of
+ * localuser. The bytes after the end of the name don't matter.
+ */
+static unsigned prefix_matches(const char b[PREFIXLEN])
+{
+	uint64_t w;
+	char c = b[9];
+
+	memcpy(&w, b, sizeof w);
+	return ((w | 0x2020202020202020u) == prefix_pattern())
+		& ((b[8] | 0x20) == localuser[8])
+		& (c == separator || c == '.' || !c);
+}
+
+/* returns the mask of the count names matching, the bit i for names[i] */
+static unsigned match_names(const char *const *names, unsigned count)
+{
+	char b[PREFIXLEN];
+	unsigned i, mask = 0;
+
+	for (i = 0 ; i < count ; i++) {
+		prefix_bytes(names[i], b);
+		mask |= prefix_matches(b) << i;
+	}
+	return mask;
+}
+
+/*
+ * Returns the mask of the BATCH names matching as prefix_matches, the bit
+ * i being for names[i]
+ */
+static unsigned match_prefixes_scalar(const char *const *names)
+{
+	return match_names(names, BATCH);
+}
+
+#if defined __x86_64__ || defined __i386__
+/*
+ * Same as match_prefixes_scalar with SSE2, one name at a time without
+ * gather: its first PREFIXLEN bytes are loaded at once and compared
+ * to "localuser" and to the separators together. The names whose page
+ * could end before PREFIXLEN bytes are matched as by the scalar one.
+ */
+__attribute__((target("sse2")))
+static unsigned match_prefixes_sse2(const char *const *names)
+{
+	const __m128i pat = _mm_setr_epi8('l', 'o', 'c', 'a', 'l', 'u', 's', 'e', 'r',
+					  0, 0, 0, 0, 0, 0, 0);
+	const __m128i low = _mm_setr_epi8(0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+					  0, 0, 0, 0, 0, 0, 0);
+	__m128i v, sep;
+	char b[PREFIXLEN];
+	unsigned i, m, mask = 0;
+
+	for (i = 0 ; i < BATCH ; i++) {
+		if (((uintptr_t)names[i] & 4095) > 4096 - PREFIXLEN) {
+			prefix_bytes(names[i], b);
+			mask |= prefix_matches(b) << i;
+			continue;
+		}
+		v = _mm_loadu_si128((const __m128i*)names[i]);
+
+		/* "localuser" in the bits 0 to 8, a dash, a dot or the end
+		 * in the bit 9 */
+		sep = _mm_or_si128(_mm_or_si128(
+				_mm_cmpeq_epi8(v, _mm_set1_epi8(separator)),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('.'))),
+			_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+		m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(v, low), pat)) & 0x1ff;
+		m |= (unsigned)_mm_movemask_epi8(sep) & 0x200;
+		mask |= (m == 0x3ff) << i;
+	}
+	return mask;
+}
+#endif
+
+#if defined __x86_64__
+/*
+ * Same as match_prefixes_scalar with AVX2, 4 names at once: their first
+ * bytes are gathered and tested together. The names whose page could
+ * end before PREFIXLEN bytes are matched one by one.
+ */
+__attribute__((target("avx2")))
+static unsigned match_prefixes_avx2(const char *const *names)
+{
+	const __m256i pat = _mm256_set1_epi64x((long long)prefix_pattern());
+	const __m256i low = _mm256_set1_epi8(0x20);
+	const __m256i byte = _mm256_set1_epi64x(0xff);
+	__m256i p, w0, w1, c, ok;
+	unsigned i, mask = 0;
+
+	for (i = 0 ; i < BATCH ; i += 4) {
+		p = _mm256_loadu_si256((const __m256i*)&names[i]);
+		if (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(
+				_mm256_and_si256(p, _mm256_set1_epi64x(4095)),
+				_mm256_set1_epi64x(4096 - PREFIXLEN))))) {
+			mask |= match_names(&names[i], 4) << i;
+			continue;
+		}
+		w0 = _mm256_i64gather_epi64(NULL, p, 1);
+		w1 = _mm256_i64gather_epi64(NULL, _mm256_add_epi64(p, _mm256_set1_epi64x(8)), 1);
+
+		/* "localuse", then "r" and a dash, a dot or the end */
+		ok = _mm256_cmpeq_epi64(_mm256_or_si256(w0, low), pat);
+		ok = _mm256_and_si256(ok, _mm256_cmpeq_epi64(
+				_mm256_and_si256(_mm256_or_si256(w1, low), byte),
+				_mm256_set1_epi64x(localuser[8])));
+		c = _mm256_and_si256(_mm256_srli_epi64(w1, 8), byte);
+		ok = _mm256_and_si256(ok, _mm256_or_si256(_mm256_or_si256(
+				_mm256_cmpeq_epi64(c, _mm256_set1_epi64x(separator)),
+				_mm256_cmpeq_epi64(c, _mm256_set1_epi64x('.'))),
+				_mm256_cmpeq_epi64(c, _mm256_setzero_si256())));
+		mask |= (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(ok)) << i;
+	}
+	return mask;
+}
+#endif
+
+/* the matcher of prefixes of the CPU */
+static unsigned (*match_prefixes)(const char *const *names) = match_prefixes_scalar;
+static pthread_once_t match_once = PTHREAD_ONCE_INIT;
+
+/* select the matcher of prefixes */
+static void select_match_prefixes(void)
+{
+#if defined __x86_64__ || defined __i386__
+	__builtin_cpu_init();
+#if defined __x86_64__
+	if (__builtin_cpu_supports("avx2"))
+		match_prefixes = match_prefixes_avx2;
+	else
+#endif
+	if (__builtin_cpu_supports("sse2"))
+		match_prefixes = match_prefixes_sse2;
+#endif
+}
+
+/* resolve the IPv4 addresses of the names */
+size_t localuser_resolve_names(const char *const *names, size_t count, uint32_t *addrs, int *status)
+{
+	static const char *const empty[BATCH] = { "", "", "", "", "", "", "", "" };
+	const char *block[BATCH];
+	const char *const *batch;
+	struct lud lud;
+	size_t i, j, n, resolved = 0;
+	uint64_t known = 0;
+	unsigned mask;
+	int rc;
+
+	pthread_once(&match_once, select_match_prefixes);
+	for (i = 0 ; i < count ; i += n) {
+		/* match the prefixes of the batch, completed by empty names */
+		n = count - i;
+		if (n >= BATCH) {
+			n = BATCH;
+			batch = &names[i];
+		} else {
+			memcpy(block, empty, sizeof block);
+			memcpy(block, &names[i], n * sizeof *block);
+			batch = block;
+		}
+		mask = match_prefixes(batch);
+
+		/* decode the matching names, the current UID being got once
+		 * for all */
+		for (j = 0 ; j < n ; j++) {
+			rc = (mask >> j) & 1 ? decode_matched_name(batch[j], &lud, &known) : 0;
+			if (rc == 1 && !lud.has_ipv4)
+				rc = -2;
+			status[i + j] = rc;
+			addrs[i + j] = rc == 1 ? lud.ipv4 : 0;
+			resolved += rc == 1;
+		}
+	}
+	return resolved;
+}
+
+/* test if the UIDs of the addresses are mapped to the ones of a namespace */
+static int uid_map_active(void)
+{
+	get_config();
+	if (!config.host_uid)
+		return 0;
+	pthread_once(&uid_map.once, read_uid_map);
+	return !uid_map.identity;
+}
+
+/* test if the kind of address has a UID */
+static int kind_has_uid(unsigned kind)
+{
+	return kind == LOCALUSER_KIND_BOTH || kind == LOCALUSER_KIND_UID
+		|| kind == LOCALUSER_KIND_LARGE_UID || kind == LOCALUSER_KIND_REPLICA;
+}
+
+/*
+ * The classifiers of addresses below store the kinds and the ids of the
+ * addresses, processing as many addresses as they can: all of them for
+ * the scalar one, a multiple of their width for the vectorized ones that
+ * leave the UIDs of the host. They add the count of valid addresses to
+ * *valid and return the count of addresses processed.
+ */
+static size_t classify_scalar(const uint32_t *addrs, size_t count, uint32_t *uids,
+			      uint32_t *appids, uint8_t *kinds, size_t *valid)
+{
+	struct lud lud;
+	size_t i;
+	int rc;
+
+	for (i = 0 ; i < count ; i++) {
+		rc = decode_ipv4_ids(addrs[i], &lud);
+		kinds[i] = (uint8_t)(rc == 1 ? classify_ipv4(ntohl(addrs[i]))
+				: rc == 0 ? LOCALUSER_KIND_NONE : LOCALUSER_KIND_RESERVED);
+		uids[i] = rc == 1 && lud.has_uid ? lud.uid : 0;
+		appids[i] = rc == 1 && lud.has_appid ? lud.appid : 0;
+		*valid += rc == 1;
+	}
+	return count;
+}
+
+#if defined __x86_64__ || defined __i386__
+/* same as classify_scalar with SSE4.1, 4 addresses at once */
+__attribute__((target("sse4.1")))
+static size_t classify_sse41(const uint32_t *addrs, size_t count, uint32_t *uids,
+			     uint32_t *appids, uint8_t *kinds, size_t *valid)
+{
+	const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m128i top_mask = _mm_set1_epi32((int)locusr_uid_only_mask);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i dynamic = _mm_set1_epi32((int)locusr_large_uid_dynamic);
+	const __m128i subuid = _mm_set1_epi32((int)config.subuid);
+	const __m128i subuid_bits = _mm_cvtsi32_si128(config.subuid_appid_bits);
+	const __m128i subuid_uid_mask = _mm_set1_epi32((int)subuid_uid_max());
+	const __m128i subuid_appid_mask = _mm_set1_epi32((int)subuid_appid_max());
+	__m128i a, in, top, both, aonly, uonly, large, replica, ok, kind, uid, appid, base, win0, offset;
+	uint32_t k;
+	size_t i;
+
+	for (i = 0 ; i + 4 <= count ; i += 4) {
+		a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&addrs[i]), bswap);
+
+		/* the masks of the kinds, exclusive */
+		in = _mm_cmpeq_epi32(_mm_and_si128(a, _mm_set1_epi32((int)prefix_mask)),
+				     _mm_set1_epi32((int)prefix_value));
+		top = _mm_and_si128(a, top_mask);
+		both = _mm_and_si128(in, _mm_cmpeq_epi32(
+				_mm_and_si128(a, _mm_set1_epi32((int)locusr_both_ids_mask)),
+				_mm_set1_epi32((int)locusr_both_ids_prefix)));
+		aonly = _mm_and_si128(in, _mm_cmpeq_epi32(top, _mm_set1_epi32((int)locusr_appid_only_prefix)));
+		uonly = _mm_and_si128(in, _mm_cmpeq_epi32(top, _mm_set1_epi32((int)locusr_uid_only_prefix)));
+		large = _mm_and_si128(in, _mm_cmpeq_epi32(top, _mm_set1_epi32((int)locusr_large_uid_prefix)));
+		replica = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(a,
+				_mm_set1_epi32((int)(locusr_replica_mask_n << locusr_replica_shift))), zero),
+			_mm_and_si128(in, _mm_cmpeq_epi32(top, _mm_set1_epi32((int)locusr_replica_prefix))));
+		ok = _mm_or_si128(_mm_or_si128(both, aonly), _mm_or_si128(_mm_or_si128(uonly, large), replica));
+
+		/* the kinds */
+		kind = _mm_or_si128(_mm_or_si128(
+				_mm_and_si128(both, _mm_set1_epi32(LOCALUSER_KIND_BOTH)),
+				_mm_and_si128(aonly, _mm_set1_epi32(LOCALUSER_KIND_APPID))),
+			_mm_or_si128(_mm_or_si128(
+				_mm_and_si128(uonly, _mm_set1_epi32(LOCALUSER_KIND_UID)),
+				_mm_and_si128(large, _mm_set1_epi32(LOCALUSER_KIND_LARGE_UID))),
+			_mm_or_si128(
+				_mm_and_si128(replica, _mm_set1_epi32(LOCALUSER_KIND_REPLICA)),
+				_mm_andnot_si128(ok, _mm_and_si128(in, _mm_set1_epi32(LOCALUSER_KIND_RESERVED))))));
+
+		/* the UIDs, the windows of large UIDs having their own layouts */
+		win0 = _mm_cmpeq_epi32(_mm_and_si128(a, _mm_set1_epi32((int)locusr_large_uid_window)), zero);
+		base = _mm_blendv_epi8(subuid, dynamic, win0);
+		offset = _mm_blendv_epi8(
+				_mm_and_si128(_mm_srl_epi32(a, subuid_bits), subuid_uid_mask),
+				_mm_and_si128(_mm_srli_epi32(a, locusr_large_uid_uid_shift),
+					_mm_set1_epi32((int)locusr_large_uid_uid_mask)),
+				win0);
+		uid = _mm_or_si128(_mm_or_si128(
+				_mm_and_si128(both, _mm_and_si128(a, _mm_set1_epi32((int)locusr_both_ids_uid_mask))),
+				_mm_and_si128(uonly, _mm_and_si128(a, _mm_set1_epi32((int)locusr_uid_only_uid_mask)))),
+			_mm_or_si128(
+				_mm_and_si128(large, _mm_add_epi32(base, offset)),
+				_mm_and_si128(replica, _mm_and_si128(
+					_mm_srli_epi32(a, locusr_replica_uid_shift),
+					_mm_set1_epi32((int)locusr_replica_uid_mask)))));
+
+		/* the APPIDs */
+		appid = _mm_or_si128(_mm_or_si128(
+				_mm_and_si128(both, _mm_and_si128(
+					_mm_srli_epi32(a, locusr_both_ids_appid_shift),
+					_mm_set1_epi32((int)locusr_both_ids_appid_mask))),
+				_mm_and_si128(aonly, _mm_and_si128(a, _mm_set1_epi32((int)locusr_appid_only_appid_mask)))),
+			_mm_or_si128(
+				_mm_and_si128(large, _mm_and_si128(a, _mm_blendv_epi8(subuid_appid_mask,
+					_mm_set1_epi32((int)locusr_large_uid_appid_mask), win0))),
+				_mm_and_si128(replica, _mm_and_si128(a, _mm_set1_epi32((int)locusr_replica_appid_mask)))));
+
+		/* store */
+		_mm_storeu_si128((__m128i*)&uids[i], uid);
+		_mm_storeu_si128((__m128i*)&appids[i], appid);
+		kind = _mm_packus_epi16(_mm_packus_epi32(kind, kind), kind);
+		k = (uint32_t)_mm_cvtsi128_si32(kind);
+		memcpy(&kinds[i], &k, sizeof k);
+		*valid += (size_t)__builtin_popcount((unsigned)_mm_movemask_ps(_mm_castsi128_ps(ok)));
+	}
+	return i;
+}
+
+/* same as classify_scalar with AVX2, 8 addresses at once */
+__attribute__((target("avx2")))
+static size_t classify_avx2(const uint32_t *addrs, size_t count, uint32_t *uids,
+			    uint32_t *appids, uint8_t *kinds, size_t *valid)
+{
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+					       3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i top_mask = _mm256_set1_epi32((int)locusr_uid_only_mask);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i dynamic = _mm256_set1_epi32((int)locusr_large_uid_dynamic);
+	const __m256i subuid = _mm256_set1_epi32((int)config.subuid);
+	const __m128i subuid_bits = _mm_cvtsi32_si128(config.subuid_appid_bits);
+	const __m256i subuid_uid_mask = _mm256_set1_epi32((int)subuid_uid_max());
+	const __m256i subuid_appid_mask = _mm256_set1_epi32((int)subuid_appid_max());
+	__m256i a, in, top, both, aonly, uonly, large, replica, ok, kind, uid, appid, base, win0, offset;
+	uint32_t k;
+	size_t i;
+
+	for (i = 0 ; i + 8 <= count ; i += 8) {
+		a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)&addrs[i]), bswap);
+
+		/* the masks of the kinds, exclusive */
+		in = _mm256_cmpeq_epi32(_mm256_and_si256(a, _mm256_set1_epi32((int)prefix_mask)),
+					_mm256_set1_epi32((int)prefix_value));
+		top = _mm256_and_si256(a, top_mask);
+		both = _mm256_and_si256(in, _mm256_cmpeq_epi32(
+				_mm256_and_si256(a, _mm256_set1_epi32((int)locusr_both_ids_mask)),
+				_mm256_set1_epi32((int)locusr_both_ids_prefix)));
+		aonly = _mm256_and_si256(in, _mm256_cmpeq_epi32(top, _mm256_set1_epi32((int)locusr_appid_only_prefix)));
+		uonly = _mm256_and_si256(in, _mm256_cmpeq_epi32(top, _mm256_set1_epi32((int)locusr_uid_only_prefix)));
+		large = _mm256_and_si256(in, _mm256_cmpeq_epi32(top, _mm256_set1_epi32((int)locusr_large_uid_prefix)));
+		replica = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(a,
+				_mm256_set1_epi32((int)(locusr_replica_mask_n << locusr_replica_shift))), zero),
+			_mm256_and_si256(in, _mm256_cmpeq_epi32(top, _mm256_set1_epi32((int)locusr_replica_prefix))));
+		ok = _mm256_or_si256(_mm256_or_si256(both, aonly),
+				     _mm256_or_si256(_mm256_or_si256(uonly, large), replica));
+
+		/* the kinds */
+		kind = _mm256_or_si256(_mm256_or_si256(
+				_mm256_and_si256(both, _mm256_set1_epi32(LOCALUSER_KIND_BOTH)),
+				_mm256_and_si256(aonly, _mm256_set1_epi32(LOCALUSER_KIND_APPID))),
+			_mm256_or_si256(_mm256_or_si256(
+				_mm256_and_si256(uonly, _mm256_set1_epi32(LOCALUSER_KIND_UID)),
+				_mm256_and_si256(large, _mm256_set1_epi32(LOCALUSER_KIND_LARGE_UID))),
+			_mm256_or_si256(
+				_mm256_and_si256(replica, _mm256_set1_epi32(LOCALUSER_KIND_REPLICA)),
+				_mm256_andnot_si256(ok, _mm256_and_si256(in, _mm256_set1_epi32(LOCALUSER_KIND_RESERVED))))));
+
+		/* the UIDs, the windows of large UIDs having their own layouts */
+		win0 = _mm256_cmpeq_epi32(_mm256_and_si256(a, _mm256_set1_epi32((int)locusr_large_uid_window)), zero);
+		base = _mm256_blendv_epi8(subuid, dynamic, win0);
+		offset = _mm256_blendv_epi8(
+				_mm256_and_si256(_mm256_srl_epi32(a, subuid_bits), subuid_uid_mask),
+				_mm256_and_si256(_mm256_srli_epi32(a, locusr_large_uid_uid_shift),
+					_mm256_set1_epi32((int)locusr_large_uid_uid_mask)),
+				win0);
+		uid = _mm256_or_si256(_mm256_or_si256(
+				_mm256_and_si256(both, _mm256_and_si256(a, _mm256_set1_epi32((int)locusr_both_ids_uid_mask))),
+				_mm256_and_si256(uonly, _mm256_and_si256(a, _mm256_set1_epi32((int)locusr_uid_only_uid_mask)))),
+			_mm256_or_si256(
+				_mm256_and_si256(large, _mm256_add_epi32(base, offset)),
+				_mm256_and_si256(replica, _mm256_and_si256(
+					_mm256_srli_epi32(a, locusr_replica_uid_shift),
+					_mm256_set1_epi32((int)locusr_replica_uid_mask)))));
+
+		/* the APPIDs */
+		appid = _mm256_or_si256(_mm256_or_si256(
+				_mm256_and_si256(both, _mm256_and_si256(
+					_mm256_srli_epi32(a, locusr_both_ids_appid_shift),
+					_mm256_set1_epi32((int)locusr_both_ids_appid_mask))),
+				_mm256_and_si256(aonly, _mm256_and_si256(a, _mm256_set1_epi32((int)locusr_appid_only_appid_mask)))),
+			_mm256_or_si256(
+				_mm256_and_si256(large, _mm256_and_si256(a, _mm256_blendv_epi8(subuid_appid_mask,
+					_mm256_set1_epi32((int)locusr_large_uid_appid_mask), win0))),
+				_mm256_and_si256(replica, _mm256_and_si256(a, _mm256_set1_epi32((int)locusr_replica_appid_mask)))));
+
+		/* store, the kinds of each half being packed in its 4 first bytes */
+		_mm256_storeu_si256((__m256i*)&uids[i], uid);
+		_mm256_storeu_si256((__m256i*)&appids[i], appid);
+		kind = _mm256_packus_epi16(_mm256_packus_epi32(kind, kind), kind);
+		k = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(kind));
+		memcpy(&kinds[i], &k, sizeof k);
+		k = (uint32_t)_mm_cvtsi128_si32(_mm256_extracti128_si256(kind, 1));
+		memcpy(&kinds[i + 4], &k, sizeof k);
+		*valid += (size_t)__builtin_popcount((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(ok)));
+	}
+	return i;
+}
+#endif
+
+/* the vectorized classifier of the CPU, if any */
+static size_t (*classify)(const uint32_t *addrs, size_t count, uint32_t *uids,
+			  uint32_t *appids, uint8_t *kinds, size_t *valid);
+static pthread_once_t classify_once = PTHREAD_ONCE_INIT;
+
+/* select the classifier */
+static void select_classify(void)
+{
+#if defined __x86_64__ || defined __i386__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		classify = classify_avx2;
+	else if (__builtin_cpu_supports("sse4.1"))
+		classify = classify_sse41;
+#endif
+}
+
+/* classify the IPv4 addresses */
+size_t localuser_classify_ipv4s(const uint32_t *addrs, size_t count, uint32_t *uids,
+				uint32_t *appids, uint8_t *kinds)
+{
+	size_t i, done, valid = 0;
+
+	get_config();
+	pthread_once(&classify_once, select_classify);
+	done = classify ? classify(addrs, count, uids, appids, kinds, &valid) : 0;
+
+	/* the vectorized classifiers give the UIDs of the host */
+	if (done && uid_map_active()) {
+		for (i = 0 ; i < done ; i++) {
+			if (kind_has_uid(kinds[i]) && !uid_from_host(uids[i], &uids[i])) {
+				kinds[i] = LOCALUSER_KIND_RESERVED;
+				uids[i] = appids[i] = 0;
+				valid--;
+			}
+		}
+	}
+	classify_scalar(&addrs[done], count - done, &uids[done], &appids[done], &kinds[done], &valid);
+	return valid;
+}
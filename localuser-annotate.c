@@ -0,0 +1,411 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * localuser-annotate.c
+ * --------------------
+ *  Annotates logs with the names of localuser: the addresses of
+ *  127.128.0.0/9 written as dotted quads, maybe IPv4-mapped as in
+ *  ::ffff:127.193.83.233, are followed by their canonical name within
+ *  parentheses or, with the option -r, replaced by it.
+ *
+ *  usage: localuser-annotate [-r] [-j JOBS] [FILE]
+ *
+ *  The file, the standard input by default, is mapped in memory when
+ *  it is a regular file and read otherwise, so that the tool works in
+ *  pipes. It is processed by blocks of lines shared by JOBS threads,
+ *  the count of processors by default, the outputs being written in
+ *  order. The addresses are searched for with SSE2 or AVX2 when the
+ *  CPU has them.
+ */
+#define _GNU_SOURCE
+#include "localuser.c"
+
+#include <ctype.h>
+#include <getopt.h>
+#if defined __x86_64__ || defined __i386__
+#include <immintrin.h>
+#endif
+
+/* size of the blocks of input processed at once */
+#define BLOCKSIZE (64 << 20)
+
+/* maximum count of threads */
+#define MAXJOBS 64
+
+/* the part of a block processed by a thread */
+struct job
+{
+	const char *data;	/* the input */
+	size_t len;		/* its length */
+	char *out;		/* the output */
+	size_t outlen;		/* its length */
+	size_t outsize;		/* its allocated size */
+	int failed;		/* out of memory */
+	int started;		/* run by the thread, to join */
+	pthread_t thread;	/* the thread */
+};
+
+/* the options */
+static int replace;
+static unsigned njobs;
+
+/* the current UID, for the names */
+static uint32_t me;
+
+/* the jobs */
+static struct job jobs[MAXJOBS];
+
+/* the finder of "127." of the CPU */
+static const char *(*find_127)(const char *p, const char *end);
+
+/* returns the first "127." of [p, end) or NULL */
+static const char *find_127_scalar(const char *p, const char *end)
+{
+	return memmem(p, (size_t)(end - p), "127.", 4);
+}
+
+#if defined __x86_64__ || defined __i386__
+/* same as find_127_scalar with SSE2, 16 positions at once */
+__attribute__((target("sse2")))
+static const char *find_127_sse2(const char *p, const char *end)
+{
+	const __m128i c1 = _mm_set1_epi8('1'), c2 = _mm_set1_epi8('2');
+	const __m128i c7 = _mm_set1_epi8('7'), dot = _mm_set1_epi8('.');
+	unsigned m;
+
+	for ( ; end - p >= 16 + 3 ; p += 16) {
+		m = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), c1),
+				      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 1)), c2)),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 2)), c7),
+				      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 3)), dot))));
+		if (m)
+			return p + __builtin_ctz(m);
+	}
+	return find_127_scalar(p, end);
+}
+
+/* same as find_127_scalar with AVX2, 32 positions at once */
+__attribute__((target("avx2")))
+static const char *find_127_avx2(const char *p, const char *end)
+{
+	const __m256i c1 = _mm256_set1_epi8('1'), c2 = _mm256_set1_epi8('2');
+	const __m256i c7 = _mm256_set1_epi8('7'), dot = _mm256_set1_epi8('.');
+	unsigned m;
+
+	for ( ; end - p >= 32 + 3 ; p += 32) {
+		m = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), c1),
+					 _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 1)), c2)),
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 2)), c7),
+					 _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 3)), dot))));
+		if (m)
+			return p + __builtin_ctz(m);
+	}
+	return find_127_scalar(p, end);
+}
+#endif
+
+/* select the finder of "127." */
+static void select_find_127(void)
+{
+	find_127 = find_127_scalar;
+#if defined __x86_64__ || defined __i386__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		find_127 = find_127_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		find_127 = find_127_sse2;
+#endif
+}
+
+/* test if c is a decimal digit */
+static int is_digit(char c)
+{
+	return '0' <= c && c <= '9';
+}
+
+/*
+ * read the dotted quad of [p, end) in *adr, in host order. Returns its
+ * length or 0 when it isn't a dotted quad ending there.
+ */
+static size_t read_quad(const char *p, const char *end, uint32_t *adr)
+{
+	const char *s = p, *first;
+	uint32_t byte;
+	unsigned i;
+
+	*adr = 0;
+	for (i = 0 ; i < 4 ; i++) {
+		if (i) {
+			if (s == end || *s != '.')
+				return 0;
+			s++;
+		}
+		for (byte = 0, first = s ; s < end && is_digit(*s) && s - first < 3 ; s++)
+			byte = 10 * byte + (uint32_t)(*s - '0');
+		if (s == first || byte > 255 || (s - first > 1 && *first == '0'))
+			return 0;
+		*adr = (*adr << 8) | byte;
+	}
+	/* not followed by more digits or by a dot and a digit */
+	if (s < end && (is_digit(*s) || (*s == '.' && s + 1 < end && is_digit(s[1]))))
+		return 0;
+	return (size_t)(s - p);
+}
+
+/* reserve len bytes of output of the job */
+static char *reserve(struct job *job, size_t len)
+{
+	size_t size;
+	char *out;
+
+	if (job->outlen + len > job->outsize) {
+		size = 2 * job->outsize > job->outlen + len ? 2 * job->outsize : job->outlen + len;
+		out = realloc(job->out, size);
+		if (!out) {
+			job->failed = 1;
+			return NULL;
+		}
+		job->out = out;
+		job->outsize = size;
+	}
+	return &job->out[job->outlen];
+}
+
+/* append the len bytes of str to the output of the job */
+static void put(struct job *job, const char *str, size_t len)
+{
+	char *out = reserve(job, len);
+
+	if (out) {
+		memcpy(out, str, len);
+		job->outlen += len;
+	}
+}
+
+/* annotate the input of the job */
+static void *annotate(void *arg)
+{
+	struct job *job = arg;
+	const char *p, *start, *copied, *end = &job->data[job->len];
+	struct lud lud;
+	uint32_t adr;
+	size_t n;
+	char *out;
+
+	job->outlen = 0;
+	job->failed = 0;
+	for (p = copied = job->data ; (p = find_127(p, end)) ; p += n) {
+		/* a dotted quad of 127.128.0.0/9 not within a word */
+		n = (p > job->data && (isalnum((unsigned char)p[-1]) || p[-1] == '.')) ? 0 : read_quad(p, end, &adr);
+		if (!n || decode_ipv4_ids(htonl(adr), &lud) != 1) {
+			n = 1;
+			continue;
+		}
+		lud.me = me;
+		measure_name(&lud);
+
+		/* replace it with its IPv4-mapped prefix or append its name */
+		start = p;
+		if (replace && p - job->data >= 7 && !strncasecmp(p - 7, "::ffff:", 7))
+			start -= 7;
+		put(job, copied, (size_t)((replace ? start : p + n) - copied));
+		out = reserve(job, lud.len + 3);
+		if (out) {
+			if (!replace)
+				*out++ = '(';
+			encode_name(&lud, out);
+			if (!replace)
+				out[lud.len] = ')';
+			job->outlen += lud.len + (replace ? 0 : 2);
+		}
+		copied = p + n;
+	}
+	put(job, copied, (size_t)(end - copied));
+	return NULL;
+}
+
+/* write the len bytes of data to the standard output */
+static int write_all(const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(1, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("localuser-annotate: write");
+			return -1;
+		}
+		data += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/* annotate the block of len bytes of data with the jobs, in order */
+static int process(const char *data, size_t len)
+{
+	const char *eol, *end = &data[len];
+	unsigned i, n;
+	size_t part;
+
+	/* share the block at ends of lines */
+	part = len / njobs + 1;
+	for (n = 0 ; n < njobs && data < end ; n++) {
+		jobs[n].data = data;
+		if ((size_t)(end - data) <= part)
+			data = end;
+		else {
+			eol = memchr(&data[part], '\n', (size_t)(end - data) - part);
+			data = eol ? eol + 1 : end;
+		}
+		jobs[n].len = (size_t)(data - jobs[n].data);
+	}
+
+	/* run the jobs, the first one in this thread */
+	for (i = 1 ; i < n ; i++)
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL, annotate, &jobs[i]);
+	if (n)
+		annotate(&jobs[0]);
+	for (i = 1 ; i < n ; i++)
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		else
+			annotate(&jobs[i]);
+
+	/* write the outputs */
+	for (i = 0 ; i < n ; i++) {
+		if (jobs[i].failed) {
+			fprintf(stderr, "localuser-annotate: out of memory\n");
+			return -1;
+		}
+		if (write_all(jobs[i].out, jobs[i].outlen))
+			return -1;
+	}
+	return 0;
+}
+
+/* annotate the file of fd mapped in memory by blocks */
+static int process_mapped(int fd, size_t size)
+{
+	const char *data, *eol, *p, *end;
+	size_t len;
+	int rc = 0;
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+	madvise((void*)data, size, MADV_SEQUENTIAL);
+	end = &data[size];
+	for (p = data ; !rc && p < end ; p += len) {
+		len = (size_t)(end - p);
+		if (len > BLOCKSIZE) {
+			eol = memrchr(p, '\n', BLOCKSIZE);
+			len = eol ? (size_t)(eol + 1 - p) : BLOCKSIZE;
+		}
+		rc = process(p, len);
+	}
+	munmap((void*)data, size);
+	return rc;
+}
+
+/* annotate the stream of fd read by blocks */
+static int process_stream(int fd)
+{
+	static char buf[BLOCKSIZE];
+	const char *eol;
+	size_t len = 0, used;
+	ssize_t n = 1;
+
+	while (n) {
+		/* fill the buffer */
+		while (n && len < sizeof buf) {
+			n = read(fd, &buf[len], sizeof buf - len);
+			if (n < 0 && errno == EINTR)
+				n = 1;
+			else if (n < 0) {
+				perror("localuser-annotate: read");
+				return -1;
+			} else
+				len += (size_t)n;
+			/* process what is there when the writer is slow */
+			if (n && len && memchr(&buf[len - (size_t)n], '\n', (size_t)n))
+				break;
+		}
+
+		/* process the complete lines */
+		eol = n ? memrchr(buf, '\n', len) : NULL;
+		used = eol ? (size_t)(eol + 1 - buf) : n && len < sizeof buf ? 0 : len;
+		if (used && process(buf, used))
+			return -1;
+		memmove(buf, &buf[used], len - used);
+		len -= used;
+	}
+	return 0;
+}
+
+static int usage(void)
+{
+	fprintf(stderr, "usage: localuser-annotate [-r] [-j JOBS] [FILE]\n");
+	return 1;
+}
+
+int main(int ac, char **av)
+{
+	struct stat st;
+	long cpus;
+	int opt, fd, rc;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	njobs = cpus < 1 ? 1 : cpus > MAXJOBS ? MAXJOBS : (unsigned)cpus;
+	while ((opt = getopt(ac, av, "rj:")) != -1) {
+		switch (opt) {
+		case 'r': replace = 1; break;
+		case 'j': njobs = (unsigned)strtoul(optarg, NULL, 10); break;
+		default: return usage();
+		}
+	}
+	if (optind + 1 < ac || !njobs || njobs > MAXJOBS)
+		return usage();
+
+	fd = 0;
+	if (optind < ac && strcmp(av[optind], "-")) {
+		fd = open(av[optind], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "localuser-annotate: can't open %s: %s\n", av[optind], strerror(errno));
+			return 1;
+		}
+	}
+
+	get_config();
+	select_find_127();
+	me = current_uid();
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+	 && lseek(fd, 0, SEEK_CUR) == 0)
+		rc = process_mapped(fd, (size_t)st.st_size);
+	else
+		rc = process_stream(fd);
+	return !!rc;
+}
@@ -0,0 +1,506 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * localuser-cli.c
+ * ---------------
+ *  The command localuser translates the names of localuser to addresses
+ *  and the addresses to names, using the code of the module but without
+ *  NSS, or enumerates ranges of names.
+ *
+ *  usage: localuser [-4|-6] [-n] [-f FILE] [ITEM...]
+ *         localuser [-4|-6] [-n] -e PATTERN...
+ *
+ *  The items, names or addresses, are the arguments or, when there is
+ *  none, the lines of FILE, mapped in memory, or of the standard input.
+ *  For each item, a line "ADDRESS NAME" is written, ADDRESS being the
+ *  IPv4 address of the name if any, otherwise its IPv6 address. The
+ *  options -4 and -6 select the family of the addresses. The option -n
+ *  writes only the translation: the address of a name, the name of an
+ *  address. The items that aren't translated give the line "- ITEM",
+ *  or "-" with -n, and the exit status 2.
+ *
+ *  With the option -e, the arguments are patterns of names whose UID
+ *  and APPID can be NUMBER, FIRST:LAST or * standing for 0:1048575, and
+ *  whose replica can be * for 1 to 3. The names of the patterns having
+ *  an address are written in order, with -n without their address:
+ *
+ *    localuser -e 'localuser-1001-*'      every APPID of the UID 1001
+ *    localuser -e 'localuser---100:199'   APPIDs 100 to 199 without UID
+ *    localuser -e 'localuser--5.*'        replicas of APPID 5 of the caller
+ *
+ *  The output is buffered by blocks of 1 MiB: millions of items are
+ *  translated each second.
+ */
+#include "localuser.c"
+
+#include <getopt.h>
+
+/* size of the buffers of input and output */
+#define BUFSIZE (1 << 20)
+
+/* maximum length of the items read from lines */
+#define MAXITEM 255
+
+/* value of * in patterns */
+static const uint32_t maxstar = (1u << 20) - 1;
+
+/* the buffered output */
+static struct
+{
+	size_t len;
+	char buf[BUFSIZE];
+} out;
+
+/* the options */
+static int family = AF_UNSPEC;
+static int only;
+
+/* the current UID, got once */
+static uint64_t known;
+
+/* count of items not translated */
+static unsigned long failures;
+
+/* a range of ids */
+struct range
+{
+	uint32_t first;
+	uint32_t last;
+};
+
+/* a pattern of names */
+struct pattern
+{
+	unsigned has_uid: 1;	/* has a UID */
+	unsigned has_appid: 1;	/* has an APPID */
+	struct range uids;	/* the UIDs if any */
+	struct range appids;	/* the APPIDs if any */
+	struct range replicas;	/* the replicas */
+};
+
+/* write the buffered output */
+static void flush_out(void)
+{
+	size_t i;
+	ssize_t n;
+
+	for (i = 0 ; i < out.len ; i += (size_t)n) {
+		n = write(1, &out.buf[i], out.len - i);
+		if (n < 0 && errno != EINTR) {
+			perror("localuser: write");
+			exit(1);
+		}
+		if (n < 0)
+			n = 0;
+	}
+	out.len = 0;
+}
+
+/* reserve len bytes of output */
+static char *reserve(size_t len)
+{
+	if (out.len + len > sizeof out.buf)
+		flush_out();
+	return &out.buf[out.len];
+}
+
+/* output the len bytes of str */
+static void put(const char *str, size_t len)
+{
+	memcpy(reserve(len), str, len);
+	out.len += len;
+}
+
+/* output the IPv4 address ipv4 in network order */
+static void put_ipv4(uint32_t ipv4)
+{
+	const uint8_t *bytes = (const uint8_t*)&ipv4;
+	char *str = reserve(16);
+	unsigned i, n;
+
+	n = write_u32(str, bytes[0]);
+	for (i = 1 ; i < 4 ; i++) {
+		str[n++] = '.';
+		n += write_u32(&str[n], bytes[i]);
+	}
+	out.len += n;
+}
+
+/* output the address of lud in the family selected, returns 0 if none */
+static int put_address(const struct lud *lud)
+{
+	uint32_t bufip[4];
+	char str[INET6_ADDRSTRLEN];
+
+	if (family == AF_INET || (family == AF_UNSPEC && lud->has_ipv4)) {
+		if (!lud->has_ipv4)
+			return 0;
+		put_ipv4(lud->ipv4);
+	} else {
+		encode_ipv6(bufip, lud);
+		inet_ntop(AF_INET6, bufip, str, sizeof str);
+		put(str, strlen(str));
+	}
+	return 1;
+}
+
+/* output the canonical name of lud */
+static void put_name(const struct lud *lud)
+{
+	encode_name(lud, reserve(lud->len + 1));
+	out.len += lud->len;
+}
+
+/* output the item not translated, cut to MAXITEM chars */
+static void put_failure(const char *item, size_t len)
+{
+	failures++;
+	if (len > MAXITEM)
+		len = MAXITEM;
+	if (only)
+		put("-\n", 2);
+	else {
+		put("- ", 2);
+		put(item, len);
+		put("\n", 1);
+	}
+}
+
+/* translate the item of len chars, followed by at least 8 zeros */
+static void translate(const char *item, size_t len)
+{
+	struct lud lud;
+	uint32_t bufip[4];
+	int rc;
+
+	if (strchr(item, ':') || ('0' <= item[0] && item[0] <= '9')) {
+		/* an address */
+		if (inet_pton(AF_INET, item, bufip) == 1)
+			rc = decode_ipv4_ids(bufip[0], &lud);
+		else if (inet_pton(AF_INET6, item, bufip) != 1)
+			rc = 0;
+		else if (bufip[0] == 0 && bufip[1] == 0 && bufip[2] == htonl(0xffff))
+			rc = decode_ipv4_ids(bufip[3], &lud);
+		else
+			rc = decode_ipv6_ids(bufip, &lud);
+		if (rc != 1) {
+			put_failure(item, len);
+			return;
+		}
+		if (lud.has_uid)
+			lud.me = known_uid(&known);
+		measure_name(&lud);
+		if (!only) {
+			put(item, len);
+			put(" ", 1);
+		}
+		put_name(&lud);
+	} else {
+		/* a name */
+		rc = match_prefix(item) ? decode_matched_name(item, &lud, &known) : 0;
+		if (rc != 1 || !put_address(&lud)) {
+			put_failure(item, len);
+			return;
+		}
+		if (!only) {
+			put(" ", 1);
+			put_name(&lud);
+		}
+	}
+	put("\n", 1);
+}
+
+/*
+ * translate the lines of the len bytes of data, the last one being
+ * translated only when final is set. Returns the count of bytes used.
+ */
+static size_t translate_lines(const char *data, size_t len, int final)
+{
+	char item[MAXITEM + 9];
+	const char *line, *eol, *next, *end = &data[len];
+	size_t n;
+
+	for (line = data ; line < end ; line = next) {
+		eol = memchr(line, '\n', (size_t)(end - line));
+		if (eol)
+			next = eol + 1;
+		else if (final)
+			next = eol = end;
+		else
+			break;
+		/* trim the blanks */
+		n = (size_t)(eol - line);
+		while (n && (*line == ' ' || *line == '\t'))
+			line++, n--;
+		while (n && (line[n - 1] == ' ' || line[n - 1] == '\t' || line[n - 1] == '\r'))
+			n--;
+		if (!n)
+			continue;
+		if (n > MAXITEM) {
+			put_failure(line, n);
+			continue;
+		}
+		memcpy(item, line, n);
+		memset(&item[n], 0, 9);
+		translate(item, n);
+	}
+	return (size_t)(line - data);
+}
+
+/* translate the lines of the file mapped in memory */
+static int translate_file(const char *path)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "localuser: can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (st.st_size) {
+		data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "localuser: can't map %s: %s\n", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+		translate_lines(data, (size_t)st.st_size, 1);
+		munmap(data, (size_t)st.st_size);
+	}
+	close(fd);
+	return 0;
+}
+
+/* translate the lines of the standard input */
+static int translate_input(void)
+{
+	static char buf[BUFSIZE];
+	size_t len = 0, used;
+	ssize_t n;
+
+	for (;;) {
+		n = read(0, &buf[len], sizeof buf - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("localuser: read");
+			return -1;
+		}
+		len += (size_t)n;
+		used = translate_lines(buf, len, !n);
+		if (!used && len == sizeof buf)
+			used = translate_lines(buf, len, 1); /* line too long */
+		memmove(buf, &buf[used], len - used);
+		len -= used;
+		if (!n)
+			return 0;
+	}
+}
+
+/* read the range at *str: NUMBER, FIRST:LAST or *, returns 0 if invalid */
+static int read_range(const char **str, struct range *range)
+{
+	int r;
+
+	if (**str == '*') {
+		(*str)++;
+		range->first = 0;
+		range->last = maxstar;
+		return 1;
+	}
+	r = read_u32(*str, &range->first);
+	if (r <= 0)
+		return 0;
+	*str += r;
+	range->last = range->first;
+	if (**str == ':') {
+		r = read_u32(++*str, &range->last);
+		if (r <= 0 || range->last < range->first)
+			return 0;
+		*str += r;
+	}
+	return 1;
+}
+
+/* read the pattern of names str, returns 0 if invalid */
+static int read_pattern(const char *str, struct pattern *pat)
+{
+	uint32_t me;
+
+	if (!match_prefix(str))
+		return 0;
+	str += sizeof localuser - 1;
+	me = known_uid(&known);
+	pat->has_uid = 1;
+	pat->has_appid = 0;
+	pat->uids.first = pat->uids.last = me;
+	pat->replicas.first = pat->replicas.last = 0;
+	if (!*str)
+		return 1;
+	if (*str++ != separator)
+		return 0;
+	if (*str == separator) {
+		/* "localuser--..." or "localuser---..." */
+		if (*++str == separator) {
+			str++;
+			pat->has_uid = 0;
+		}
+		pat->has_appid = 1;
+	} else {
+		if (!read_range(&str, &pat->uids))
+			return 0;
+		if (*str == separator) {
+			str++;
+			pat->has_appid = 1;
+		}
+	}
+	if (pat->has_appid) {
+		if (!read_range(&str, &pat->appids))
+			return 0;
+		if (*str == '.') {
+			if (*++str == '*') {
+				pat->replicas.first = 1;
+				pat->replicas.last = locusr_replica_max;
+			} else if ('1' <= *str && *str <= (char)('0' + locusr_replica_max))
+				pat->replicas.first = pat->replicas.last = (uint32_t)(*str - '0');
+			else
+				return 0;
+			str++;
+		}
+	}
+	return !*str;
+}
+
+/* output the entry of lud if it has an address, returns 0 if none */
+static int put_entry(struct lud *lud)
+{
+	size_t len = out.len;
+
+	if (encode_lud(lud) != 1)
+		return 0;
+	if (only)
+		put_name(lud);
+	else {
+		if (!put_address(lud)) {
+			out.len = len;
+			return 0;
+		}
+		put(" ", 1);
+		put_name(lud);
+	}
+	put("\n", 1);
+	return 1;
+}
+
+/*
+ * enumerate the names of the pattern having an address. For a UID and
+ * a replica, the APPIDs having an address are the ones up to a limit.
+ */
+static int enumerate(const char *str)
+{
+	struct pattern pat;
+	struct lud lud;
+	uint64_t uid, appid, replica;
+	int found;
+
+	if (!read_pattern(str, &pat)) {
+		fprintf(stderr, "localuser: invalid pattern %s\n", str);
+		return -1;
+	}
+	lud.me = known_uid(&known);
+	lud.has_uid = pat.has_uid;
+	lud.has_appid = pat.has_appid;
+	for (uid = pat.uids.first ; uid <= pat.uids.last ; uid++) {
+		lud.uid = (uint32_t)uid;
+		if (!pat.has_appid) {
+			lud.replica = 0;
+			put_entry(&lud);
+			continue;
+		}
+		for (appid = pat.appids.first ; appid <= pat.appids.last ; appid++) {
+			lud.appid = (uint32_t)appid;
+			found = 0;
+			for (replica = pat.replicas.first ; replica <= pat.replicas.last ; replica++) {
+				lud.replica = (unsigned)replica & locusr_replica_mask_n;
+				found |= put_entry(&lud);
+			}
+			if (!found)
+				break;
+		}
+		if (!pat.has_uid)
+			break;
+	}
+	return 0;
+}
+
+static int usage(void)
+{
+	fprintf(stderr, "usage: localuser [-4|-6] [-n] [-f FILE] [ITEM...]\n"
+			"       localuser [-4|-6] [-n] -e PATTERN...\n");
+	return 1;
+}
+
+int main(int ac, char **av)
+{
+	const char *file = NULL;
+	char item[MAXITEM + 9];
+	int opt, enumerating = 0, rc = 0;
+	size_t len;
+
+	while ((opt = getopt(ac, av, "46nef:")) != -1) {
+		switch (opt) {
+		case '4': family = AF_INET; break;
+		case '6': family = AF_INET6; break;
+		case 'n': only = 1; break;
+		case 'e': enumerating = 1; break;
+		case 'f': file = optarg; break;
+		default: return usage();
+		}
+	}
+	if ((enumerating && (file || optind == ac)) || (file && optind < ac))
+		return usage();
+
+	get_config();
+	if (enumerating)
+		for ( ; !rc && optind < ac ; optind++)
+			rc = enumerate(av[optind]);
+	else if (file)
+		rc = translate_file(file);
+	else if (optind == ac)
+		rc = translate_input();
+	else
+		for ( ; optind < ac ; optind++) {
+			len = strlen(av[optind]);
+			if (len > MAXITEM)
+				put_failure(av[optind], len);
+			else {
+				memcpy(item, av[optind], len);
+				memset(&item[len], 0, 9);
+				translate(item, len);
+			}
+		}
+	flush_out();
+	return rc ? 1 : failures ? 2 : 0;
+}
@@ -0,0 +1,467 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * localuser-mkdb.c
+ * ----------------
+ *  Compiles the indexes of names mapped by the module: the registry of
+ *  application names or, with the option -p, the index of user names.
+ *
+ *  usage: localuser-mkdb [-p] [-o OUTPUT] [INPUT]
+ *         localuser-mkdb [-p] -l [DB]
+ *
+ *  The input, /etc/nss-localuser-apps by default, is made of lines
+ *  "NAME APPID". Empty lines and lines starting with # are ignored.
+ *  The names are made of letters, digits and dashes, start with a
+ *  letter, don't end with a dash and have at most 63 chars. They are
+ *  stored in lower case. The name "app" is reserved for the application
+ *  of the caller. The names and the APPIDs must be unique and
+ *  the greatest APPID must be less than the lowest plus 1048576.
+ *
+ *  The output is by default the registry of the configuration,
+ *  /etc/nss-localuser-apps.db. It is written in a temporary file
+ *  renamed at end so that the module never sees a partial file.
+ *
+ *  With the option -p, the input is /etc/passwd by default and the
+ *  output is the index of the configuration, /etc/nss-localuser-users.db.
+ *  Only the users whose names are made of lower case letters and digits
+ *  and whose UIDs are less than 1048576 are indexed. The index must be
+ *  compiled again when users are changed, the module then maps it again
+ *  without ever calling getpwnam.
+ *
+ *  The option -l lists the entries of a compiled index.
+ */
+#include "localuser.c"
+
+#include <getopt.h>
+
+/* the entries read */
+struct item
+{
+	char name[MAXNAMELEN + 1];	/* the name, lower case */
+	uint32_t len;			/* its length */
+	uint32_t id;			/* its id */
+	uint32_t order;			/* order of reading */
+	uint64_t hash;			/* hash of the name */
+};
+
+/* maximum length of the reverse table, the range of APPIDs in IPv4 */
+static const uint32_t maxspan = 1u << 20;
+
+/* count of tries of displacements of a bucket before changing the seed */
+static const uint32_t maxtries = 1u << 24;
+
+/* the list of items */
+struct list
+{
+	struct item *items;	/* the items */
+	size_t count;		/* count of items */
+	size_t alloc;		/* count of allocated items */
+};
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(((const struct item*)a)->name, ((const struct item*)b)->name);
+}
+
+static int cmp_id(const void *a, const void *b)
+{
+	uint32_t x = ((const struct item*)a)->id, y = ((const struct item*)b)->id;
+	return x < y ? -1 : x > y;
+}
+
+/* compare by ids then by order of reading */
+static int cmp_id_order(const void *a, const void *b)
+{
+	int rc = cmp_id(a, b);
+	return rc ? rc : (int)((const struct item*)a)->order - (int)((const struct item*)b)->order;
+}
+
+/* compare by names then by order of reading */
+static int cmp_name_order(const void *a, const void *b)
+{
+	int rc = cmp_name(a, b);
+	return rc ? rc : (int)((const struct item*)a)->order - (int)((const struct item*)b)->order;
+}
+
+/* check that name is valid and lower its case, returns its length or 0 */
+static uint32_t check_name(char *name)
+{
+	uint32_t len;
+	char c;
+
+	for (len = 0 ; name[len] ; len++) {
+		/* only the upper case letters are lowered, the other bytes
+		 * being checked as they are */
+		c = name[len];
+		if (c >= 'A' && c <= 'Z')
+			c = name[len] = (char)(c | 0x20);
+		if ((c < 'a' || c > 'z') && (len == 0 || ((c < '0' || c > '9') && c != separator)))
+			return 0;
+	}
+	return len <= MAXNAMELEN && name[len - 1] != separator && strcmp(name, appkeyword) ? len : 0;
+}
+
+/* add the item of name and id to the list, returns 0 or -1 */
+static int add_item(struct list *list, const char *name, uint32_t id)
+{
+	struct item *it;
+
+	if (list->count == list->alloc) {
+		list->alloc = list->alloc ? 2 * list->alloc : 64;
+		it = realloc(list->items, list->alloc * sizeof *it);
+		if (!it) {
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+		list->items = it;
+	}
+	it = &list->items[list->count];
+	strcpy(it->name, name);
+	it->len = (uint32_t)strlen(name);
+	it->id = id;
+	it->order = (uint32_t)list->count++;
+	return 0;
+}
+
+/* read the items of the file of path made of lines "NAME ID", returns 0 or -1 */
+static int read_items(const char *path, struct list *list)
+{
+	FILE *file;
+	char line[256], name[128], id[64], *end;
+	unsigned long val;
+	unsigned lino;
+	int rc;
+
+	file = fopen(path, "re");
+	if (!file) {
+		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (lino = 1 ; fgets(line, (int)sizeof line, file) ; lino++) {
+		rc = sscanf(line, " %127s %63s", name, id);
+		if (rc == EOF || name[0] == '#')
+			continue;
+		errno = 0;
+		val = strtoul(id, &end, 10);
+		if (rc != 2 || !check_name(name) || *end || errno || val >= idx_none || id[0] == '-') {
+			fprintf(stderr, "%s:%u: bad line\n", path, lino);
+			goto error;
+		}
+		if (add_item(list, name, (uint32_t)val))
+			goto error;
+	}
+	fclose(file);
+	return 0;
+
+error:
+	fclose(file);
+	return -1;
+}
+
+/*
+ * Read the users of the file of path in the format of /etc/passwd,
+ * returns 0 or -1. Only the names made of lower case letters and digits
+ * are kept because the names of users are case sensitive and because
+ * the dash separates the APPID. The UIDs greater than the range of the
+ * reverse table are skipped, as the entries whose name or UID are
+ * already given by a previous entry.
+ */
+static int read_passwd(const char *path, struct list *list)
+{
+	FILE *file;
+	char line[1024], *name, *uid, *end;
+	unsigned long val;
+	size_t i, j, len;
+
+	file = fopen(path, "re");
+	if (!file) {
+		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, (int)sizeof line, file)) {
+		name = line;
+		len = strcspn(name, ":");
+		if (!len || len > MAXNAMELEN || name[len] != ':'
+		 || name[0] < 'a' || name[0] > 'z'
+		 || strspn(name, "abcdefghijklmnopqrstuvwxyz0123456789") != len)
+			continue;
+		name[len] = 0;
+		if (!strcmp(name, appkeyword))
+			continue;
+		uid = strchr(&name[len + 1], ':');
+		if (!uid)
+			continue;
+		errno = 0;
+		val = strtoul(++uid, &end, 10);
+		if (*end != ':' || end == uid || errno || val >= maxspan)
+			continue;
+		if (add_item(list, name, (uint32_t)val)) {
+			fclose(file);
+			return -1;
+		}
+	}
+	fclose(file);
+
+	/* keep the first entry of each UID and of each name */
+	qsort(list->items, list->count, sizeof *list->items, cmp_id_order);
+	for (i = j = 0 ; i < list->count ; i++)
+		if (!j || list->items[j - 1].id != list->items[i].id)
+			list->items[j++] = list->items[i];
+	qsort(list->items, j, sizeof *list->items, cmp_name_order);
+	for (list->count = i = 0 ; i < j ; i++)
+		if (!list->count || strcmp(list->items[list->count - 1].name, list->items[i].name))
+			list->items[list->count++] = list->items[i];
+	return 0;
+}
+
+/*
+ * Compute the perfect hash of the n items: the displacements of the
+ * buckets and the slot of each item. The buckets are placed from the
+ * biggest to the smallest, each one with the first displacement that
+ * sends its items to free and distinct slots. Returns 0 on success or
+ * -1 when the seed must be changed.
+ */
+static int place(struct item *items, uint32_t n, uint32_t nbuckets,
+		 uint32_t *disp, uint32_t *slots)
+{
+	uint32_t *first, *next, *order, *sizes, *taken;
+	uint32_t b, i, j, k, d, s, size, nfilled;
+	int rc = -1;
+
+	first = malloc(nbuckets * sizeof *first);
+	order = malloc(nbuckets * sizeof *order);
+	sizes = calloc(nbuckets, sizeof *sizes);
+	next = malloc(n * sizeof *next);
+	taken = calloc(n, sizeof *taken);
+	if (!first || !order || !sizes || !next || !taken)
+		goto end;
+
+	/* lists of items of the buckets */
+	for (b = 0 ; b < nbuckets ; b++)
+		first[b] = idx_none;
+	for (i = 0 ; i < n ; i++) {
+		b = hash_bucket(items[i].hash, nbuckets);
+		next[i] = first[b];
+		first[b] = i;
+		sizes[b]++;
+	}
+
+	/* order of the not empty buckets by decreasing sizes */
+	for (size = 0, b = 0 ; b < nbuckets ; b++)
+		if (sizes[b] > size)
+			size = sizes[b];
+	for (nfilled = 0 ; size ; size--)
+		for (b = 0 ; b < nbuckets ; b++)
+			if (sizes[b] == size)
+				order[nfilled++] = b;
+	for (b = 0 ; b < nbuckets ; b++)
+		disp[b] = 0;
+
+	/* place the buckets, taken[s] is 1 + the index of the item */
+	for (k = 0 ; k < nfilled ; k++) {
+		b = order[k];
+		for (d = 0 ; d < maxtries ; d++) {
+			for (i = first[b] ; i != idx_none ; i = next[i]) {
+				s = hash_slot(items[i].hash, d, n);
+				if (taken[s])
+					break;
+				taken[s] = i + 1;
+			}
+			if (i == idx_none)
+				break;
+			/* undo */
+			for (j = first[b] ; j != i ; j = next[j])
+				taken[hash_slot(items[j].hash, d, n)] = 0;
+		}
+		if (d == maxtries)
+			goto end;
+		disp[b] = d;
+	}
+	for (s = 0 ; s < n ; s++)
+		slots[s] = taken[s] - 1;
+	rc = 0;
+end:
+	free(first);
+	free(order);
+	free(sizes);
+	free(next);
+	free(taken);
+	return rc;
+}
+
+/* write the index of the n items in the file of path */
+static int write_index(const char *path, struct item *items, uint32_t n)
+{
+	struct idxhead head;
+	struct idxentry ent;
+	uint32_t *disp, *slots, *reverse, i, off;
+	char *tmp;
+	FILE *file;
+	int fd, rc = 1;
+
+	/* check the unicity */
+	qsort(items, n, sizeof *items, cmp_name);
+	for (i = 1 ; i < n ; i++)
+		if (!strcmp(items[i - 1].name, items[i].name)) {
+			fprintf(stderr, "name %s is duplicated\n", items[i].name);
+			return 1;
+		}
+	qsort(items, n, sizeof *items, cmp_id);
+	for (i = 1 ; i < n ; i++)
+		if (items[i - 1].id == items[i].id) {
+			fprintf(stderr, "id %u is duplicated\n", items[i].id);
+			return 1;
+		}
+
+	/* the header */
+	memset(&head, 0, sizeof head);
+	memcpy(head.magic, IDX_MAGIC, sizeof head.magic);
+	head.count = n;
+	head.nbuckets = n / 4 + 1;
+	head.base = n ? items[0].id : 0;
+	head.span = n ? items[n - 1].id - items[0].id + 1 : 0;
+	if (head.span > maxspan) {
+		fprintf(stderr, "ids %u to %u are too sparse\n", items[0].id, items[n - 1].id);
+		return 1;
+	}
+	for (i = 0 ; i < n ; i++)
+		head.names += items[i].len;
+
+	/* the perfect hash */
+	disp = malloc(head.nbuckets * sizeof *disp);
+	slots = malloc((n + 1) * sizeof *slots);
+	reverse = malloc((head.span + 1) * sizeof *reverse);
+	tmp = malloc(strlen(path) + 8);
+	if (!disp || !slots || !reverse || !tmp) {
+		fprintf(stderr, "out of memory\n");
+		goto end;
+	}
+	do {
+		head.seed++;
+		for (i = 0 ; i < n ; i++)
+			items[i].hash = hash_name(head.seed, items[i].name, items[i].len);
+	} while (n && place(items, n, head.nbuckets, disp, slots));
+	for (i = 0 ; i < head.nbuckets && !n ; i++)
+		disp[i] = 0;
+	for (i = 0 ; i < head.span ; i++)
+		reverse[i] = idx_none;
+	for (i = 0 ; i < n ; i++)
+		reverse[items[slots[i]].id - head.base] = i;
+
+	/* write in a temporary file */
+	strcat(strcpy(tmp, path), ".XXXXXX");
+	fd = mkstemp(tmp);
+	file = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!file) {
+		fprintf(stderr, "can't create %s: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+	fwrite(&head, sizeof head, 1, file);
+	fwrite(disp, sizeof *disp, head.nbuckets, file);
+	for (i = off = 0 ; i < n ; i++) {
+		ent.id = items[slots[i]].id;
+		ent.name = off;
+		ent.len = items[slots[i]].len;
+		fwrite(&ent, sizeof ent, 1, file);
+		off += ent.len;
+	}
+	fwrite(reverse, sizeof *reverse, head.span, file);
+	for (i = 0 ; i < n ; i++)
+		fwrite(items[slots[i]].name, 1, items[slots[i]].len, file);
+	if (fchmod(fd, 0644) || fflush(file) || ferror(file) || fsync(fd)
+	 || fclose(file) || rename(tmp, path)) {
+		fprintf(stderr, "can't write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		goto end;
+	}
+	rc = 0;
+end:
+	free(disp);
+	free(slots);
+	free(reverse);
+	free(tmp);
+	return rc;
+}
+
+/* list the entries of the index of path in the order of the ids */
+static int list_index(const char *path)
+{
+	struct idxmap *map;
+	const struct idxentry *ent;
+	uint32_t i;
+
+	map = idxmap_open(path);
+	if (!map) {
+		fprintf(stderr, "can't read %s\n", path);
+		return 1;
+	}
+	for (i = 0 ; i < map->head->span ; i++) {
+		ent = index_find_id(map, map->head->base + i);
+		if (ent)
+			printf("%.*s %u\n", (int)ent->len, &map->names[ent->name], ent->id);
+	}
+	idxmap_close(map);
+	return 0;
+}
+
+static int usage(void)
+{
+	fprintf(stderr, "usage: localuser-mkdb [-p] [-o OUTPUT] [INPUT]\n"
+			"       localuser-mkdb [-p] -l [DB]\n");
+	return 1;
+}
+
+int main(int ac, char **av)
+{
+	const char *input, *output;
+	struct list list;
+	int opt, list_db = 0, passwd = 0, rc;
+
+	get_config();
+	output = NULL;
+	while ((opt = getopt(ac, av, "o:lp")) != -1) {
+		switch (opt) {
+		case 'o': output = optarg; break;
+		case 'l': list_db = 1; break;
+		case 'p': passwd = 1; break;
+		default: return usage();
+		}
+	}
+	if (optind + 1 < ac)
+		return usage();
+	if (!output)
+		output = passwd ? config.users : config.apps;
+	if (list_db)
+		return list_index(optind < ac ? av[optind] : output);
+	input = optind < ac ? av[optind] : passwd ? "/etc/passwd" : "/etc/nss-localuser-apps";
+
+	memset(&list, 0, sizeof list);
+	rc = passwd ? read_passwd(input, &list) : read_items(input, &list);
+	if (!rc && list.count >= maxspan) {
+		fprintf(stderr, "too many entries\n");
+		rc = -1;
+	}
+	if (!rc)
+		rc = write_index(output, list.items, (uint32_t)list.count);
+	free(list.items);
+	return !!rc;
+}
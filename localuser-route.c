@@ -0,0 +1,145 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * localuser-route.c
+ * -----------------
+ *  Installs or removes the route making local the prefix of the native
+ *  IPv6 addresses of localuser, as would do the command:
+ *
+ *    ip -6 route add local PREFIX/64 dev lo table local
+ *
+ *  usage: localuser-route [add|del] [PREFIX]
+ *
+ *  The default prefix is the one of the configuration of the module.
+ *  The route is sent through netlink so it works in an unprivileged
+ *  user and network namespace (unshare -rn).
+ */
+#include "localuser.c"
+
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/* a netlink request of route */
+struct request
+{
+	struct nlmsghdr hdr;
+	struct rtmsg rtm;
+	char attrs[64];
+};
+
+/* append the attribute of type and value of len to the request */
+static void add_attr(struct request *req, unsigned short type, const void *value, size_t len)
+{
+	struct rtattr *rta;
+
+	rta = (struct rtattr*)((char*)req + NLMSG_ALIGN(req->hdr.nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = (unsigned short)RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), value, len);
+	req->hdr.nlmsg_len = NLMSG_ALIGN(req->hdr.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* send the route request for prefix, returns 0 or an errno */
+static int send_route(int add, const uint8_t *prefix)
+{
+	struct request req;
+	struct sockaddr_nl nl;
+	uint8_t dst[16];
+	char reply[512];
+	struct nlmsghdr *hdr;
+	struct nlmsgerr *err;
+	int fd, oif;
+	ssize_t len;
+
+	oif = (int)if_nametoindex("lo");
+	if (!oif)
+		return errno;
+
+	memset(&req, 0, sizeof req);
+	req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof req.rtm);
+	req.hdr.nlmsg_type = add ? RTM_NEWROUTE : RTM_DELROUTE;
+	req.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | (add ? NLM_F_CREATE | NLM_F_REPLACE : 0);
+	req.hdr.nlmsg_seq = 1;
+	req.rtm.rtm_family = AF_INET6;
+	req.rtm.rtm_dst_len = 64;
+	req.rtm.rtm_table = RT_TABLE_LOCAL;
+	req.rtm.rtm_protocol = RTPROT_BOOT;
+	req.rtm.rtm_scope = RT_SCOPE_HOST;
+	req.rtm.rtm_type = RTN_LOCAL;
+	memset(dst, 0, sizeof dst);
+	memcpy(dst, prefix, 8);
+	add_attr(&req, RTA_DST, dst, sizeof dst);
+	add_attr(&req, RTA_OIF, &oif, sizeof oif);
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return errno;
+	memset(&nl, 0, sizeof nl);
+	nl.nl_family = AF_NETLINK;
+	if (sendto(fd, &req, req.hdr.nlmsg_len, 0, (struct sockaddr*)&nl, sizeof nl) < 0
+	 || (len = recv(fd, reply, sizeof reply, 0)) < 0) {
+		close(fd);
+		return errno;
+	}
+	close(fd);
+
+	hdr = (struct nlmsghdr*)reply;
+	if (!NLMSG_OK(hdr, (unsigned)len) || hdr->nlmsg_type != NLMSG_ERROR)
+		return EPROTO;
+	err = (struct nlmsgerr*)NLMSG_DATA(hdr);
+	return -err->error;
+}
+
+int main(int ac, char **av)
+{
+	uint8_t addr6[16];
+	char text[INET6_ADDRSTRLEN];
+	int add, rc;
+
+	add = ac < 2 || !strcmp(av[1], "add");
+	if (ac > 3 || (ac > 1 && !add && strcmp(av[1], "del"))) {
+		fprintf(stderr, "usage: localuser-route [add|del] [PREFIX]\n");
+		return 1;
+	}
+
+	get_config();
+	memset(addr6, 0, sizeof addr6);
+	if (ac == 3) {
+		if (inet_pton(AF_INET6, av[2], addr6) != 1) {
+			fprintf(stderr, "bad prefix %s\n", av[2]);
+			return 1;
+		}
+	} else
+		memcpy(addr6, config.ipv6_prefix, sizeof config.ipv6_prefix);
+
+	rc = send_route(add, addr6);
+	memset(&addr6[8], 0, 8);
+	inet_ntop(AF_INET6, addr6, text, sizeof text);
+	if (rc) {
+		fprintf(stderr, "can't %s route local %s/64: %s\n",
+			add ? "add" : "del", text, strerror(rc));
+		return 1;
+	}
+	printf("route local %s/64 dev lo %s\n", text, add ? "added" : "removed");
+	return 0;
+}
@@ -0,0 +1,513 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * localuser-top.c
+ * ---------------
+ *  Accounts the sockets of the loopback per identity of localuser: the
+ *  TCP and UDP sockets of IPv4 and IPv6 whose local or remote address
+ *  is in 127.128.0.0/9, maybe IPv4-mapped, are dumped by the kernel
+ *  through NETLINK_SOCK_DIAG with a filter of bytecode, so that the
+ *  other sockets never reach the tool. Each socket is counted for the
+ *  identity of its local address or, when it isn't of localuser, of
+ *  its remote one, the replicas being counted with their identity.
+ *
+ *  usage: localuser-top [-s] [-d SECONDS] [-n ITERATIONS]
+ *
+ *  By default, the identities having the most sockets are shown and
+ *  refreshed every 2 seconds or the given delay, with the bytes sent
+ *  and received per second by their TCP sockets. With -s, a snapshot
+ *  of all the identities is written once as tab-separated values.
+ */
+#include "localuser.c"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/tcp.h>
+
+/* size of the buffer of the dumps */
+#define DUMPSIZE (1 << 16)
+
+/* the range of the addresses of localuser, 127.128.0.0/9 */
+#define PREFIX 0x7f800000u
+#define PREFIXLEN 9
+
+/* the state TCP_TIME_WAIT of the kernel, not dumped */
+#define TIME_WAIT 6
+
+/* initial count of slots of the table of identities */
+#define MINSLOTS 256
+
+/* the counters of an identity */
+struct account
+{
+	uint64_t key;		/* the identity, 0 for a free slot */
+	uint64_t tcp;		/* count of TCP sockets */
+	uint64_t udp;		/* count of UDP sockets */
+	uint64_t sent;		/* bytes sent by the TCP sockets */
+	uint64_t received;	/* bytes received by the TCP sockets */
+	uint64_t rate_sent;	/* bytes sent per second */
+	uint64_t rate_received;	/* bytes received per second */
+};
+
+/* a table of identities, open addressed */
+struct table
+{
+	struct account *slots;	/* the slots */
+	size_t size;		/* count of slots, a power of 2 */
+	size_t count;		/* count of identities */
+};
+
+/* the request of a dump filtered on 127.128.0.0/9 */
+struct request
+{
+	struct nlmsghdr nlh;
+	struct inet_diag_req_v2 req;
+	struct rtattr rta;
+	struct {
+		struct inet_diag_bc_op src;	/* source in the range */
+		struct inet_diag_hostcond srccond;
+		uint32_t srcaddr;
+		struct inet_diag_bc_op jmp;	/* then accept */
+		struct inet_diag_bc_op dst;	/* destination in the range */
+		struct inet_diag_hostcond dstcond;
+		uint32_t dstaddr;
+	} bc;
+};
+
+/* the current UID, for the names */
+static uint32_t me;
+
+/* set by SIGINT and SIGTERM */
+static volatile sig_atomic_t stopped;
+
+/* the key of the identity of lud */
+static uint64_t key_of_lud(const struct lud *lud)
+{
+	return (uint64_t)lud->uid << 22 | (uint64_t)lud->appid << 2
+		| (uint64_t)lud->has_appid << 1 | lud->has_uid;
+}
+
+/* the identity of key, without replica */
+static void lud_of_key(uint64_t key, struct lud *lud)
+{
+	memset(lud, 0, sizeof *lud);
+	lud->has_uid = key & 1;
+	lud->has_appid = (key >> 1) & 1;
+	lud->appid = (uint32_t)(key >> 2) & 0xfffff;
+	lud->uid = (uint32_t)(key >> 22);
+	lud->me = me;
+}
+
+/* the slot of key in table, NULL when out of memory */
+static struct account *lookup(struct table *table, uint64_t key)
+{
+	struct account *slots, *slot;
+	size_t i, j;
+
+	/* grow at 3/4 */
+	if (4 * (table->count + 1) > 3 * table->size) {
+		slots = calloc(table->size ? 2 * table->size : MINSLOTS, sizeof *slots);
+		if (!slots)
+			return NULL;
+		for (i = 0 ; i < table->size ; i++)
+			if (table->slots[i].key) {
+				j = table->slots[i].key * 0x9e3779b97f4a7c15u >> 32;
+				while (slots[j &= (table->size ? 2 * table->size : MINSLOTS) - 1].key)
+					j++;
+				slots[j] = table->slots[i];
+			}
+		free(table->slots);
+		table->slots = slots;
+		table->size = table->size ? 2 * table->size : MINSLOTS;
+	}
+
+	j = key * 0x9e3779b97f4a7c15u >> 32;
+	for ( ; ; j++) {
+		slot = &table->slots[j & (table->size - 1)];
+		if (slot->key == key)
+			return slot;
+		if (!slot->key) {
+			slot->key = key;
+			table->count++;
+			return slot;
+		}
+	}
+}
+
+/* empty the table */
+static void clear(struct table *table)
+{
+	if (table->slots)
+		memset(table->slots, 0, table->size * sizeof *table->slots);
+	table->count = 0;
+}
+
+/* the IPv4 address of the address of family, or 0 when it has none */
+static uint32_t ipv4_of(uint8_t family, const uint32_t addr[4])
+{
+	if (family == AF_INET)
+		return addr[0];
+	if (!addr[0] && !addr[1] && addr[2] == htonl(0xffff))
+		return addr[3];
+	return 0;
+}
+
+/* account the socket of the message r of protocol */
+static int account(struct table *table, const struct inet_diag_msg *r, size_t len, int protocol)
+{
+	const struct rtattr *attr, *info = NULL;
+	const struct tcp_info *tcpi;
+	struct account *slot;
+	struct lud lud;
+	size_t alen;
+
+	/* the identity of the local address or of the remote one */
+	if (decode_ipv4_ids(ipv4_of(r->idiag_family, r->id.idiag_src), &lud) != 1
+	 && decode_ipv4_ids(ipv4_of(r->idiag_family, r->id.idiag_dst), &lud) != 1)
+		return 0;
+	slot = lookup(table, key_of_lud(&lud));
+	if (!slot)
+		return -1;
+	if (protocol == IPPROTO_UDP) {
+		slot->udp++;
+		return 0;
+	}
+	slot->tcp++;
+
+	/* the counters of bytes, when the kernel gives them */
+	alen = len - NLMSG_ALIGN(sizeof *r);
+	for (attr = (const struct rtattr*)(r + 1) ; RTA_OK(attr, alen) ; attr = RTA_NEXT(attr, alen))
+		if (attr->rta_type == INET_DIAG_INFO)
+			info = attr;
+	if (info && RTA_PAYLOAD(info) >= (int)(offsetof(struct tcp_info, tcpi_bytes_received) + 8)) {
+		tcpi = RTA_DATA(info);
+		slot->sent += tcpi->tcpi_bytes_acked;
+		slot->received += tcpi->tcpi_bytes_received;
+	}
+	return 0;
+}
+
+/* dump the sockets of family and protocol through fd into table */
+static int dump(int fd, struct table *table, uint8_t family, int protocol)
+{
+	static char buf[DUMPSIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	struct request rq;
+	struct nlmsghdr *h;
+	ssize_t n;
+	size_t len;
+
+	/* the filter: source in 127.128.0.0/9, otherwise destination */
+	memset(&rq, 0, sizeof rq);
+	rq.nlh.nlmsg_len = sizeof rq;
+	rq.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	rq.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	rq.req.sdiag_family = family;
+	rq.req.sdiag_protocol = (uint8_t)protocol;
+	rq.req.idiag_states = ~(1u << TIME_WAIT);
+	rq.req.idiag_ext = protocol == IPPROTO_TCP ? 1 << (INET_DIAG_INFO - 1) : 0;
+	rq.rta.rta_type = INET_DIAG_REQ_BYTECODE;
+	rq.rta.rta_len = RTA_LENGTH(sizeof rq.bc);
+	rq.bc.src.code = INET_DIAG_BC_S_COND;
+	rq.bc.src.yes = (uint8_t)offsetof(typeof(rq.bc), jmp);
+	rq.bc.src.no = (uint16_t)offsetof(typeof(rq.bc), dst);
+	rq.bc.srccond.family = AF_INET;
+	rq.bc.srccond.prefix_len = PREFIXLEN;
+	rq.bc.srccond.port = -1;
+	rq.bc.srcaddr = htonl(PREFIX);
+	rq.bc.jmp.code = INET_DIAG_BC_JMP;
+	rq.bc.jmp.yes = sizeof rq.bc.jmp;
+	rq.bc.jmp.no = (uint16_t)(sizeof rq.bc - offsetof(typeof(rq.bc), jmp)); /* to the end: accept */
+	rq.bc.dst.code = INET_DIAG_BC_D_COND;
+	rq.bc.dst.yes = (uint8_t)(sizeof rq.bc - offsetof(typeof(rq.bc), dst));
+	rq.bc.dst.no = (uint16_t)(rq.bc.dst.yes + 4);	/* past the end: reject */
+	rq.bc.dstcond = rq.bc.srccond;
+	rq.bc.dstaddr = rq.bc.srcaddr;
+	if (sendto(fd, &rq, sizeof rq, 0, (struct sockaddr*)&nladdr, sizeof nladdr) < 0)
+		return -1;
+
+	for (;;) {
+		n = recv(fd, buf, sizeof buf, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		len = (size_t)n;
+		for (h = (struct nlmsghdr*)buf ; NLMSG_OK(h, len) ; h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				if (h->nlmsg_len >= NLMSG_LENGTH(sizeof(struct nlmsgerr)))
+					errno = -((struct nlmsgerr*)NLMSG_DATA(h))->error;
+				return -1;
+			}
+			if (h->nlmsg_type == SOCK_DIAG_BY_FAMILY
+			 && h->nlmsg_len >= NLMSG_LENGTH(sizeof(struct inet_diag_msg))
+			 && account(table, NLMSG_DATA(h), h->nlmsg_len - NLMSG_HDRLEN, protocol))
+				return -1;
+		}
+	}
+}
+
+/* take a snapshot of the sockets into table */
+static int snapshot(struct table *table)
+{
+	static const uint8_t families[] = { AF_INET, AF_INET6 };
+	static const int protocols[] = { IPPROTO_TCP, IPPROTO_UDP };
+	unsigned f, p;
+	int fd, rc = 0;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd < 0)
+		return -1;
+	clear(table);
+	for (f = 0 ; !rc && f < sizeof families / sizeof *families ; f++)
+		for (p = 0 ; !rc && p < sizeof protocols / sizeof *protocols ; p++)
+			rc = dump(fd, table, families[f], protocols[p]);
+	close(fd);
+	return rc;
+}
+
+/* compute the rates of table since previous, delay seconds before */
+static void compute_rates(struct table *table, struct table *previous, double delay)
+{
+	struct account *slot, *old;
+	size_t i, j;
+
+	for (i = 0 ; i < table->size ; i++) {
+		slot = &table->slots[i];
+		if (!slot->key || !previous->size)
+			continue;
+		for (j = slot->key * 0x9e3779b97f4a7c15u >> 32 ; ; j++) {
+			old = &previous->slots[j & (previous->size - 1)];
+			if (!old->key || old->key == slot->key)
+				break;
+		}
+		/* closed sockets make the totals decrease */
+		if (old->key && slot->sent > old->sent)
+			slot->rate_sent = (uint64_t)((double)(slot->sent - old->sent) / delay);
+		if (old->key && slot->received > old->received)
+			slot->rate_received = (uint64_t)((double)(slot->received - old->received) / delay);
+	}
+}
+
+/* order of the accounts, most sockets then most bytes first */
+static int compare(const void *a, const void *b)
+{
+	const struct account *x = *(const struct account *const*)a, *y = *(const struct account *const*)b;
+	uint64_t sx = x->tcp + x->udp, sy = y->tcp + y->udp;
+
+	if (sx != sy)
+		return sx < sy ? 1 : -1;
+	sx = x->rate_sent + x->rate_received;
+	sy = y->rate_sent + y->rate_received;
+	if (sx != sy)
+		return sx < sy ? 1 : -1;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* the accounts of table sorted, NULL when out of memory */
+static struct account **sorted(const struct table *table)
+{
+	struct account **accounts;
+	size_t i, n;
+
+	accounts = malloc((table->count + 1) * sizeof *accounts);
+	if (!accounts)
+		return NULL;
+	for (i = n = 0 ; i < table->size ; i++)
+		if (table->slots[i].key)
+			accounts[n++] = &table->slots[i];
+	qsort(accounts, n, sizeof *accounts, compare);
+	return accounts;
+}
+
+/* write the canonical name of key in name of size bytes */
+static void name_of_key(uint64_t key, char *name, size_t size)
+{
+	struct lud lud;
+
+	lud_of_key(key, &lud);
+	measure_name(&lud);
+	if (lud.len < size) {
+		encode_name(&lud, name);
+		name[lud.len] = 0;
+	} else
+		snprintf(name, size, "?");
+}
+
+/* write the snapshot of table as tab-separated values */
+static int write_snapshot(const struct table *table)
+{
+	struct account **accounts;
+	char name[256];
+	struct lud lud;
+	size_t i;
+
+	accounts = sorted(table);
+	if (!accounts)
+		return -1;
+	printf("name\tuid\tappid\ttcp\tudp\tsent\treceived\n");
+	for (i = 0 ; i < table->count ; i++) {
+		lud_of_key(accounts[i]->key, &lud);
+		name_of_key(accounts[i]->key, name, sizeof name);
+		printf("%s\t", name);
+		printf(lud.has_uid ? "%" PRIu32 "\t" : "-\t", lud.uid);
+		printf(lud.has_appid ? "%" PRIu32 "\t" : "-\t", lud.appid);
+		printf("%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+			accounts[i]->tcp, accounts[i]->udp, accounts[i]->sent, accounts[i]->received);
+	}
+	free(accounts);
+	return fflush(stdout) ? -1 : 0;
+}
+
+/* format count of bytes as in top: B, K, M, G */
+static const char *human(uint64_t count, char buf[16])
+{
+	static const char units[] = "BKMGTPE";
+	double value = (double)count;
+	unsigned i = 0;
+
+	while (value >= 10000 && units[i + 1]) {
+		value /= 1024;
+		i++;
+	}
+	snprintf(buf, 16, i ? "%.1f%c" : "%.0f%c", value, units[i]);
+	return buf;
+}
+
+/* show the view of table on the terminal */
+static int show(const struct table *table, double delay)
+{
+	struct account **accounts;
+	struct winsize ws;
+	uint64_t tcp = 0, udp = 0;
+	char name[256], b[4][16];
+	time_t now = time(NULL);
+	size_t i, rows = 24;
+
+	accounts = sorted(table);
+	if (!accounts)
+		return -1;
+	if (!ioctl(1, TIOCGWINSZ, &ws) && ws.ws_row > 4)
+		rows = ws.ws_row;
+	for (i = 0 ; i < table->count ; i++) {
+		tcp += accounts[i]->tcp;
+		udp += accounts[i]->udp;
+	}
+	printf("\033[H\033[2J");
+	printf("localuser-top - %.8s - every %gs\n", ctime(&now) + 11, delay);
+	printf("identities: %zu, tcp: %" PRIu64 ", udp: %" PRIu64 "\n\n", table->count, tcp, udp);
+	printf("%-24s %8s %8s %9s %9s %9s %9s\n", "NAME", "TCP", "UDP", "SENT/s", "RECV/s", "SENT", "RECV");
+	for (i = 0 ; i < table->count && i + 5 < rows ; i++) {
+		name_of_key(accounts[i]->key, name, sizeof name);
+		printf("%-24s %8" PRIu64 " %8" PRIu64 " %9s %9s %9s %9s\n", name,
+			accounts[i]->tcp, accounts[i]->udp,
+			human(accounts[i]->rate_sent, b[0]), human(accounts[i]->rate_received, b[1]),
+			human(accounts[i]->sent, b[2]), human(accounts[i]->received, b[3]));
+	}
+	free(accounts);
+	return fflush(stdout) ? -1 : 0;
+}
+
+static void stop(int sig)
+{
+	(void)sig;
+	stopped = 1;
+}
+
+static int usage(void)
+{
+	fprintf(stderr, "usage: localuser-top [-s] [-d SECONDS] [-n ITERATIONS]\n");
+	return 1;
+}
+
+int main(int ac, char **av)
+{
+	struct table tables[2] = {{ 0 }}, *table = &tables[0], *previous = &tables[1], *swap;
+	struct sigaction sa = { .sa_handler = stop };
+	struct timespec ts;
+	unsigned long iterations = 0, i;
+	double delay = 2;
+	char *end;
+	int opt, once = 0;
+
+	while ((opt = getopt(ac, av, "sd:n:")) != -1) {
+		switch (opt) {
+		case 's': once = 1; break;
+		case 'd':
+			delay = strtod(optarg, &end);
+			if (*end || !(delay >= 0.1))
+				return usage();
+			break;
+		case 'n':
+			iterations = strtoul(optarg, &end, 10);
+			if (*end || !iterations)
+				return usage();
+			break;
+		default: return usage();
+		}
+	}
+	if (optind < ac)
+		return usage();
+
+	get_config();
+	me = current_uid();
+	if (once) {
+		if (snapshot(table) || write_snapshot(table)) {
+			fprintf(stderr, "localuser-top: %s\n", strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	for (i = 0 ; !stopped && (!iterations || i < iterations) ; i++) {
+		if (i) {
+			ts.tv_sec = (time_t)delay;
+			ts.tv_nsec = (long)((delay - (double)ts.tv_sec) * 1e9);
+			while (nanosleep(&ts, &ts) && errno == EINTR && !stopped);
+			if (stopped)
+				break;
+		}
+		if (snapshot(table)) {
+			fprintf(stderr, "localuser-top: %s\n", strerror(errno));
+			return 1;
+		}
+		compute_rates(table, previous, delay);
+		if (show(table, delay))
+			return 1;
+		swap = table;
+		table = previous;
+		previous = swap;
+	}
+	return 0;
+}
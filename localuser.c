@@ -72,7 +72,26 @@
  *  This is represented by the following hostnames: `localuser`
  *  and `localuser-UID`.
  *  
- *  The values `000` and `001` of `abb` are reserved for futur use.
+ *  When `abb` is `000`, the 20 bits value `ccccdddddeeeffffffff` encodes
+ *  large UIDs with small APPIDs: the first bit is the window and the 19
+ *  following bits are the offset of the UID in the window then the APPID.
+ *  The window 0 starts at UID 61184 and has 13 bits of UID and 6 bits of
+ *  APPID: 8192 UIDs covering the dynamic users of systemd, up to 65519,
+ *  with the APPIDs 0 to 63. The window 1 starts at the first subordinated
+ *  UID of the configuration, 100000 by default, and has 6 bits of APPID
+ *  by default, so 8192 UIDs only: a single range of /etc/subuid usually
+ *  has 65536 UIDs. The count of its bits of APPID can be configured from
+ *  0 to 13, 3 covering 65536 UIDs with the APPIDs 0 to 7.
+ *  This is represented by the hostname `localuser-UID-APPID` when it
+ *  doesn't fit the 11 bits layout.
+ *  
+ *  When `abb` is `001`, the 20 bits value `ccccdddddeeeffffffff` encodes
+ *  the replicas of applications: the 2 first bits are the replica number
+ *  (1 to 3, 0 is reserved), the 11 next bits are the UID and the 7 last
+ *  bits are the APPID. This is represented by the hostnames
+ *  `localuser--APPID.N` and `localuser-UID-APPID.N` where N is the
+ *  replica number. The replicas give distinct addresses to a same
+ *  application, multiplying the connections that can be opened to it.
  *  
  *  Examples:
  *  
@@ -82,22 +101,48 @@
  *  localuser-1024 => 127.128.4.0   (for any user)
  *  ```
  *  
+ *  The APPID can also be given by the name of the application in the
+ *  registry compiled by localuser-mkdb, as in `localuser--homescreen`,
+ *  and the UID by the name of the user in the index compiled from
+ *  /etc/passwd, as in `localuser-alice`. The keyword `app` stands for the
+ *  application of the caller found in its SMACK label or its cgroup, as
+ *  in `localuser-app` or `localuser-UID-app`.
+ *  
+ *  For IPv6, the address is by default the IPv4-mapped address. When the
+ *  configuration sets `ipv6 native`, it is instead the 64 bits prefix of
+ *  the configuration (fd00:6c6f:6375:7372::/64 by default) followed by
+ *  the UID on 32 bits and the APPID on 32 bits, 0xffffffff meaning none.
+ *  The replicas keep their IPv4-mapped address.
+ *  
  *  The service also provides the reverse resolution.
  * links
  * -----
  *  [1] https://www.gnu.org/software/libc/manual/html_node/Name-Service-Switch.html
  */
+
+/* tells liblocaluser.c that this file is already included */
+#define LOCALUSER_C
+
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
 #include <netdb.h>
 #include <nss.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "localuser.h"
 
 /* string for "localuser" */
 static const char localuser[] = "localuser";
 static const char separator = '-';
-#define MAXNAMELEN 40
 
 /* defines the length of adresses */
 static const int lenip4 = 4;
@@ -120,121 +165,1356 @@ static const uint32_t locusr_appid_only_prefix     = 0x7fb00000u;
 static const uint32_t locusr_appid_only_appid_max  = 0x000fffffu;
 static const uint32_t locusr_appid_only_appid_mask = 0x000fffffu;
 
-static const uint32_t locusr_uid_only_mask         = 0x7ff00000u;
-static const uint32_t locusr_uid_only_prefix       = 0x7fa00000u;
-static const uint32_t locusr_uid_only_uid_max      = 0x000fffffu;
-static const uint32_t locusr_uid_only_uid_mask     = 0x000fffffu;
+static const uint32_t locusr_uid_only_mask         = 0x7ff00000u;
+static const uint32_t locusr_uid_only_prefix       = 0x7fa00000u;
+static const uint32_t locusr_uid_only_uid_max      = 0x000fffffu;
+static const uint32_t locusr_uid_only_uid_mask     = 0x000fffffu;
+
+static const uint32_t locusr_large_uid_mask        = 0x7ff00000u;
+static const uint32_t locusr_large_uid_prefix      = 0x7f800000u;
+static const uint32_t locusr_large_uid_window      = 0x00080000u;
+static const uint32_t locusr_large_uid_uid_max     = 0x00001fffu;
+static const uint32_t locusr_large_uid_uid_mask    = 0x00001fffu;
+static const uint8_t  locusr_large_uid_uid_shift   = 6;
+static const uint32_t locusr_large_uid_appid_max   = 0x0000003fu;
+static const uint32_t locusr_large_uid_appid_mask  = 0x0000003fu;
+static const uint32_t locusr_large_uid_dynamic     = 61184;  /* systemd's DynamicUser */
+static const uint32_t locusr_large_uid_subuid      = 100000; /* default subordinated UIDs */
+static const uint8_t  locusr_large_uid_appid_bits  = 6;      /* default APPID bits of window 1 */
+static const uint8_t  locusr_large_uid_appid_bits_max = 13;
+
+static const uint32_t locusr_replica_mask          = 0x7ff00000u;
+static const uint32_t locusr_replica_prefix        = 0x7f900000u;
+static const uint32_t locusr_replica_max           = 0x00000003u;
+static const uint32_t locusr_replica_mask_n        = 0x00000003u;
+static const uint8_t  locusr_replica_shift         = 18;
+static const uint32_t locusr_replica_uid_max       = 0x000007ffu;
+static const uint32_t locusr_replica_uid_mask      = 0x000007ffu;
+static const uint8_t  locusr_replica_uid_shift     = 7;
+static const uint32_t locusr_replica_appid_max     = 0x0000007fu;
+static const uint32_t locusr_replica_appid_mask    = 0x0000007fu;
+
+/* native IPv6 addresses */
+static const uint32_t locusr_ipv6_none             = 0xffffffffu; /* no UID or no APPID */
+static const uint8_t  locusr_ipv6_prefix[8]        = {    /* fd00:6c6f:6375:7372::/64 */
+	0xfd, 0x00, 0x6c, 0x6f, 0x63, 0x75, 0x73, 0x72
+};
+
+/* path of the configuration file */
+#ifndef CONFIG_FILE
+#define CONFIG_FILE "/etc/nss-localuser.conf"
+#endif
+
+/* path of the registry of application names */
+#ifndef APPS_FILE
+#define APPS_FILE "/etc/nss-localuser-apps.db"
+#endif
+
+/* path of the index of the users */
+#ifndef USERS_FILE
+#define USERS_FILE "/etc/nss-localuser-users.db"
+#endif
+
+/* count and length of the local domains of the configuration */
+#define MAXDOMAINS 8
+#define MAXDOMAINLEN 191
+
+/* length of the paths of the configuration */
+#define MAXPATHLEN 191
+
+/* families answered for AF_UNSPEC by gethostbyname4_r */
+enum unspec_mode
+{
+	unspec_inet,	/* only IPv4 (default) */
+	unspec_inet6,	/* only IPv6 (IPv4-mapped or native, see ipv6) */
+	unspec_both	/* IPv4 then IPv6 (IPv4-mapped or native, see ipv6) */
+};
+
+/* sources of the identity of the application of the caller */
+enum app_source
+{
+	app_none,	/* no source (default) */
+	app_smack,	/* SMACK label of the process */
+	app_cgroup	/* cgroup of the process */
+};
+
+/* the configuration */
+static struct
+{
+	enum unspec_mode unspec;
+	int32_t ttl;	/* time to live of answers in seconds */
+	unsigned effective_uid: 1;	/* current user is the effective UID */
+	unsigned uid_cache: 1;		/* cache the UID of the current user */
+	unsigned authoritative: 1;	/* invalid names are definitively not found */
+	unsigned host_uid: 1;		/* addresses use UIDs of the initial namespace */
+	uint32_t subuid;		/* first UID of the window 1 of large UIDs */
+	uint8_t subuid_appid_bits;	/* count of bits of APPID of the window 1 */
+	unsigned ipv6_native: 1;	/* IPv6 addresses are native */
+	uint8_t ipv6_prefix[8];		/* prefix of native IPv6 addresses */
+	char apps[MAXPATHLEN + 1];	/* registry of application names */
+	char users[MAXPATHLEN + 1];	/* index of user names */
+	enum app_source app_source;	/* source of the application of the caller */
+	unsigned app_prefix_set: 1;	/* app_prefix is set */
+	char app_prefix[MAXDOMAINLEN + 1]; /* prefix of the identity before the name */
+	unsigned ndomains;		/* count of local domains */
+	char domains[MAXDOMAINS][MAXDOMAINLEN + 1]; /* the local domains */
+} config = {
+	.unspec = unspec_inet,
+	.ttl = INT32_MAX,
+	.effective_uid = 0,
+	.uid_cache = 0,
+	.authoritative = 0,
+	.host_uid = 0,
+	.subuid = locusr_large_uid_subuid,
+	.subuid_appid_bits = locusr_large_uid_appid_bits,
+	.ipv6_native = 0,
+	.apps = APPS_FILE,
+	.users = USERS_FILE,
+	.app_source = app_none,
+	.ndomains = 0
+};
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+/* greatest offset of UID in the window 1 of large UIDs */
+static uint32_t subuid_uid_max(void)
+{
+	return (locusr_large_uid_window >> config.subuid_appid_bits) - 1;
+}
+
+/* greatest APPID of the window 1 of large UIDs */
+static uint32_t subuid_appid_max(void)
+{
+	return (1u << config.subuid_appid_bits) - 1;
+}
+
+/*
+ * Cached UID of the current user when the configuration sets uid-cache.
+ * The value is the UID ORed with uid_cache_valid or 0 when not cached.
+ */
+static uint64_t uid_cache;
+static const uint64_t uid_cache_valid = (uint64_t)1 << 32;
+
+/* structure for coding/decoding */
+struct lud
+{
+	unsigned has_uid: 1;	/* has a uid */
+	unsigned has_appid: 1;	/* has a appid */
+	unsigned replica: 2;	/* replica number or 0 */
+	unsigned has_ipv4: 1;	/* has an IPv4 address */
+	unsigned ipv6_mapped: 1; /* IPv6 address is IPv4-mapped, not native */
+	uint32_t uid;		/* uid if any */
+	uint32_t hostuid;	/* uid in the initial user namespace */
+	uint32_t appid;		/* appid if any */
+	uint32_t me;		/* uid of the current user */
+	uint32_t ipv4;		/* IPv4 representation */
+	uint32_t len;		/* length of the canonical name */
+};
+
+/* maximum count of digits of a 32 bits integer */
+#define MAXDIGITS 10
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * Count the leading digits of the 8 characters of the word w, loaded in
+ * little endian order: the first character is the low byte.
+ */
+static int count_digits8(uint64_t w)
+{
+	uint64_t flags;
+
+	/* a byte of flags is not null if the character isn't a digit */
+	flags = ((w & 0xf0f0f0f0f0f0f0f0u) ^ 0x3030303030303030u)
+	      | (((w + 0x0606060606060606u) & 0xf0f0f0f0f0f0f0f0u) ^ 0x3030303030303030u);
+	return flags ? __builtin_ctzll(flags) >> 3 : 8;
+}
+
+/*
+ * Get the value of the n (1 to 8) leading digits of the word w, loaded in
+ * little endian order. The digits are shifted to the top of the word so
+ * that the missing ones are leading zeros, then pairs, quads and octets
+ * of digits are combined by multiplications.
+ */
+static uint32_t value_digits8(uint64_t w, int n)
+{
+	w = (w - 0x3030303030303030u) << (8 * (8 - n));
+	w = (w * 10) + (w >> 8);
+	w = (((w & 0x000000ff000000ffu) * (100 + (1000000ull << 32)))
+	   + (((w >> 16) & 0x000000ff000000ffu) * (1 + (10000ull << 32)))) >> 32;
+	return (uint32_t)w;
+}
+#endif
+
+/*
+ * Read a 32 bits integer written in canonical form: at most MAXDIGITS
+ * digits and no leading zero. Returns its length in characters, 0 if
+ * there is no digit, or -1 when not canonical or on overflow.
+ *
+ * Most of the time, 8 characters are read at once. It is done only when
+ * they are in the same page than the first one, so that characters
+ * after the terminating zero can be read without fault.
+ */
+static int read_u32(const char *str, uint32_t *val)
+{
+	uint64_t a;
+	int p;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t w;
+
+	if (((uintptr_t)str & 4095) <= 4096 - sizeof w) {
+		memcpy(&w, str, sizeof w);
+		p = count_digits8(w);
+		a = p ? value_digits8(w, p) : 0;
+		if (p == 8)
+			while (p <= MAXDIGITS && '0' <= str[p] && str[p] <= '9')
+				a = 10 * a + (uint64_t)(str[p++] - '0');
+	} else
+#endif
+	{
+		a = 0;
+		p = 0;
+		while (p <= MAXDIGITS && '0' <= str[p] && str[p] <= '9')
+			a = 10 * a + (uint64_t)(str[p++] - '0');
+	}
+	if (p > MAXDIGITS || a > UINT32_MAX || (p > 1 && str[0] == '0'))
+		return -1; /* overflow or leading zero */
+	*val = (uint32_t)a;
+	return p;
+}
+
+/* the decimal representation of the numbers from 0 to 99 */
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* powers of 10, except 0 for the first so that 0 has 1 digit */
+static const uint32_t pow10_u32[10] = {
+	0, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+/*
+ * Count of digits of a 32 bits integer. The count is first approximated
+ * from the count of bits (1233 / 4096 is about log10(2)) and then
+ * corrected by comparing with the power of 10.
+ */
+static unsigned count_u32(uint32_t val)
+{
+	unsigned n;
+
+	n = ((32 - (unsigned)__builtin_clz(val | 1)) * 1233) >> 12;
+	return n + (val >= pow10_u32[n]);
+}
+
+/*
+ * Write a 32 bits integer and return the count of char writen. The
+ * count of digits is computed first, then the digits are written two
+ * by two from the end.
+ */
+static unsigned write_u32(char *str, uint32_t val)
+{
+	unsigned n, w, r;
+
+	n = w = count_u32(val);
+	while (val >= 100) {
+		r = val % 100;
+		val /= 100;
+		w -= 2;
+		memcpy(&str[w], &digit_pairs[2 * r], 2);
+	}
+	if (val >= 10)
+		memcpy(str, &digit_pairs[2 * val], 2);
+	else
+		str[0] = (char)('0' + val);
+	return n;
+}
+
+/* read a boolean value, returns 0 if not valid */
+static int read_bool(const char *value, unsigned *val)
+{
+	if (!strcmp(value, "yes") || !strcmp(value, "on") || !strcmp(value, "true"))
+		*val = 1;
+	else if (!strcmp(value, "no") || !strcmp(value, "off") || !strcmp(value, "false"))
+		*val = 0;
+	else
+		return 0;
+	return 1;
+}
+
+static void reset_indexes(void);
+
+/* forget the cached UID */
+static void flush_uid_cache(void)
+{
+	__atomic_store_n(&uid_cache, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read the configuration file. Lines are of the form "key value".
+ * Empty lines and lines starting with # are ignored, as are unknown
+ * keys and values.
+ */
+static void read_config(void)
+{
+	FILE *file;
+	char line[256], key[64], value[192], *end;
+	long n;
+	unsigned b;
+	uint8_t addr6[16];
+
+	memcpy(config.ipv6_prefix, locusr_ipv6_prefix, sizeof config.ipv6_prefix);
+	file = fopen(CONFIG_FILE, "re");
+	if (!file)
+		return;
+
+	while (fgets(line, (int)sizeof line, file)) {
+		if (sscanf(line, " %63s %191s", key, value) != 2 || key[0] == '#')
+			continue;
+		if (!strcmp(key, "unspec")) {
+			if (!strcmp(value, "inet"))
+				config.unspec = unspec_inet;
+			else if (!strcmp(value, "inet6"))
+				config.unspec = unspec_inet6;
+			else if (!strcmp(value, "both"))
+				config.unspec = unspec_both;
+		} else if (!strcmp(key, "ttl")) {
+			n = strtol(value, &end, 10);
+			if (!*end && 0 <= n && n <= INT32_MAX)
+				config.ttl = (int32_t)n;
+		} else if (!strcmp(key, "uid")) {
+			if (!strcmp(value, "real"))
+				config.effective_uid = 0;
+			else if (!strcmp(value, "effective"))
+				config.effective_uid = 1;
+		} else if (!strcmp(key, "uid-cache")) {
+			if (read_bool(value, &b))
+				config.uid_cache = b;
+		} else if (!strcmp(key, "authoritative")) {
+			if (read_bool(value, &b))
+				config.authoritative = b;
+		} else if (!strcmp(key, "host-uid")) {
+			if (read_bool(value, &b))
+				config.host_uid = b;
+		} else if (!strcmp(key, "subuid-base")) {
+			/* the windows must not overlap */
+			n = strtol(value, &end, 10);
+			if (!*end && n > (long)(locusr_large_uid_dynamic + locusr_large_uid_uid_max)
+			 && n <= (long)UINT32_MAX)
+				config.subuid = (uint32_t)n;
+		} else if (!strcmp(key, "subuid-appid-bits")) {
+			n = strtol(value, &end, 10);
+			if (!*end && 0 <= n && n <= locusr_large_uid_appid_bits_max)
+				config.subuid_appid_bits = (uint8_t)n;
+		} else if (!strcmp(key, "ipv6")) {
+			if (!strcmp(value, "mapped"))
+				config.ipv6_native = 0;
+			else if (!strcmp(value, "native"))
+				config.ipv6_native = 1;
+		} else if (!strcmp(key, "ipv6-prefix")) {
+			/* a /64 prefix, the suffix /64 being optional */
+			end = strchr(value, '/');
+			if (end && strcmp(end, "/64"))
+				continue;
+			if (end)
+				*end = 0;
+			if (inet_pton(AF_INET6, value, addr6) == 1)
+				memcpy(config.ipv6_prefix, addr6, sizeof config.ipv6_prefix);
+		} else if (!strcmp(key, "app-registry")) {
+			if (value[0] == '/')
+				strcpy(config.apps, value);
+		} else if (!strcmp(key, "user-index")) {
+			if (value[0] == '/')
+				strcpy(config.users, value);
+		} else if (!strcmp(key, "app-source")) {
+			if (!strcmp(value, "none"))
+				config.app_source = app_none;
+			else if (!strcmp(value, "smack"))
+				config.app_source = app_smack;
+			else if (!strcmp(value, "cgroup"))
+				config.app_source = app_cgroup;
+		} else if (!strcmp(key, "app-prefix")) {
+			config.app_prefix_set = 1;
+			strcpy(config.app_prefix, strcmp(value, "none") ? value : "");
+		} else if (!strcmp(key, "domain")) {
+			n = (long)strlen(value);
+			if (value[n - 1] == '.')
+				value[--n] = 0;
+			if (n && value[0] != '.' && config.ndomains < MAXDOMAINS)
+				strcpy(config.domains[config.ndomains++], value);
+		}
+	}
+	fclose(file);
+
+	/* the window 1 of large UIDs must not wrap */
+	if (config.subuid > UINT32_MAX - subuid_uid_max())
+		config.subuid = locusr_large_uid_subuid;
+
+	/* a child may change its UID before the parent does */
+	if (config.uid_cache)
+		pthread_atfork(NULL, NULL, flush_uid_cache);
+	pthread_atfork(NULL, NULL, reset_indexes);
+}
+
+/* ensure the configuration is read */
+static void get_config(void)
+{
+	pthread_once(&config_once, read_config);
+}
+
+/*
+ * Get the UID of the current user: the real or the effective UID
+ * depending on the configuration. When uid-cache is set, the UID is
+ * only asked to the kernel once per process (and again after fork).
+ */
+static uint32_t current_uid(void)
+{
+	uint64_t cache;
+	uint32_t uid;
+
+	get_config();
+	if (config.uid_cache) {
+		cache = __atomic_load_n(&uid_cache, __ATOMIC_RELAXED);
+		if (cache & uid_cache_valid)
+			return (uint32_t)cache;
+	}
+	uid = (uint32_t)(config.effective_uid ? geteuid() : getuid());
+	if (config.uid_cache)
+		__atomic_store_n(&uid_cache, uid_cache_valid | uid, __ATOMIC_RELAXED);
+	return uid;
+}
+
+/*
+ * The indexes of names are files compiled by localuser-mkdb and mapped
+ * in memory. They associate names to 32 bits ids, as the names of the
+ * applications to their APPID or the names of the users to their UID.
+ * An index is made of:
+ *
+ *  - the header (struct idxhead);
+ *  - the displacements of the buckets of the perfect hash, nbuckets u32;
+ *  - the entries (struct idxentry), count of them, each one being at
+ *    the slot given by the perfect hash of its name;
+ *  - the reverse table, span u32: the slot of the entry of the id
+ *    base + i or idx_none;
+ *  - the names, in lower case and not terminated.
+ *
+ * The name of an entry is looked up by hashing it to a bucket and then,
+ * using the displacement of the bucket, to a slot where the name is
+ * compared. The id of an entry is looked up in the reverse table.
+ * The file is in the byte order of the host.
+ */
+#define IDX_MAGIC "LUIDX1\n"
+#define MAXNAMELEN 63
+
+struct idxhead
+{
+	char magic[8];		/* IDX_MAGIC */
+	uint32_t count;		/* count of entries */
+	uint32_t nbuckets;	/* count of buckets */
+	uint32_t seed;		/* seed of the hash */
+	uint32_t base;		/* first id of the reverse table */
+	uint32_t span;		/* length of the reverse table */
+	uint32_t names;		/* size of the names */
+};
+
+struct idxentry
+{
+	uint32_t id;		/* the id */
+	uint32_t name;		/* offset of the name */
+	uint32_t len;		/* length of the name */
+};
+
+static const uint32_t idx_none = 0xffffffffu;
+
+/* a mapped index */
+struct idxmap
+{
+	void *map;			/* the mapping */
+	size_t size;			/* its size */
+	dev_t dev;			/* device of the file */
+	ino_t ino;			/* inode of the file */
+	struct timespec mtime;		/* modification of the file */
+	const struct idxhead *head;	/* the header */
+	const uint32_t *disp;		/* the displacements */
+	const struct idxentry *entries;	/* the entries */
+	const uint32_t *reverse;	/* the reverse table */
+	const char *names;		/* the names */
+	struct idxmap *next;		/* next retired mapping */
+	uint32_t epoch;			/* epoch of its retirement */
+};
+
+/*
+ * An index file and its mapping. The file is checked at most once per
+ * second and mapped again when changed: the new mapping is published
+ * atomically and the lookups are never locked. The files must be
+ * replaced by rename, never rewritten.
+ *
+ * The lookups in progress are counted in the slot of the parity of the
+ * epoch they started in. A replaced mapping is retired with the current
+ * epoch, which is then incremented as soon as the slot of the next one
+ * is empty: that slot gets no new lookup afterward, so it empties in the
+ * time of a lookup, and the mappings retired before the current epoch
+ * are released then. A lookup never stops the checks of the file.
+ */
+struct index
+{
+	const char *path;		/* path of the file */
+	struct idxmap *current;		/* the mapping in use or NULL */
+	struct idxmap *retired;		/* the replaced mappings maybe still used */
+	uint32_t epoch;			/* epoch of the lookups */
+	uint32_t users[2];		/* count of lookups per parity of epoch */
+	int busy;			/* a check is in progress */
+	time_t next_check;		/* time of the next check of the file */
+};
+
+/* the registry of application names */
+static struct index apps_index = { .path = config.apps };
+
+/* the index of user names, made from /etc/passwd */
+static struct index users_index = { .path = config.users };
+
+/* finalization of the 64 bits hash of murmur3 */
+static uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdu;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53u;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Hash of the name of len chars. The names are made of letters, digits
+ * and dashes so setting the bit 0x20 of the chars lowers their case.
+ */
+static uint64_t hash_name(uint32_t seed, const char *name, size_t len)
+{
+	uint64_t h;
+	size_t i;
+
+	h = 0xcbf29ce484222325u ^ seed;
+	for (i = 0 ; i < len ; i++)
+		h = (h ^ (uint8_t)(name[i] | 0x20)) * 0x100000001b3u;
+	return mix64(h);
+}
+
+/* bucket of the hash h */
+static uint32_t hash_bucket(uint64_t h, uint32_t nbuckets)
+{
+	return (uint32_t)((h >> 32) % nbuckets);
+}
+
+/* slot of the hash h for the displacement disp */
+static uint32_t hash_slot(uint64_t h, uint32_t disp, uint32_t count)
+{
+	return (uint32_t)(mix64(h + disp * 0x9e3779b97f4a7c15u) % count);
+}
+
+/* unmap the index map */
+static void idxmap_close(struct idxmap *map)
+{
+	munmap(map->map, map->size);
+	free(map);
+}
+
+/*
+ * Map the index file of path. Its content is checked so that a bad file
+ * can't lead to read out of the mapping. Returns NULL on error or when
+ * the index is empty.
+ */
+static struct idxmap *idxmap_open(const char *path)
+{
+	struct idxmap *map;
+	const struct idxhead *head;
+	const struct idxentry *ent;
+	struct stat st;
+	uint64_t size;
+	uint32_t i;
+	void *mem;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof *head) {
+		close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	/* check the sizes */
+	head = mem;
+	size = sizeof *head
+		+ (uint64_t)head->nbuckets * sizeof(uint32_t)
+		+ (uint64_t)head->count * sizeof(struct idxentry)
+		+ (uint64_t)head->span * sizeof(uint32_t)
+		+ head->names;
+	map = NULL;
+	if (memcmp(head->magic, IDX_MAGIC, sizeof head->magic) || !head->count
+	 || !head->nbuckets || size != (uint64_t)st.st_size
+	 || !(map = malloc(sizeof *map)))
+		goto error;
+	map->map = mem;
+	map->size = (size_t)st.st_size;
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	map->mtime = st.st_mtim;
+	map->head = head;
+	map->disp = (const uint32_t*)&head[1];
+	map->entries = (const struct idxentry*)&map->disp[head->nbuckets];
+	map->reverse = (const uint32_t*)&map->entries[head->count];
+	map->names = (const char*)&map->reverse[head->span];
+	map->next = NULL;
+	map->epoch = 0;
+
+	/* check the entries and the reverse table */
+	for (i = 0 ; i < head->count ; i++) {
+		ent = &map->entries[i];
+		if (!ent->len || ent->len > MAXNAMELEN || ent->name > head->names
+		 || ent->len > head->names - ent->name
+		 || ent->id - head->base >= head->span
+		 || map->reverse[ent->id - head->base] != i)
+			goto error;
+	}
+	for (i = 0 ; i < head->span ; i++)
+		if (map->reverse[i] != idx_none && map->reverse[i] >= head->count)
+			goto error;
+	return map;
+
+error:
+	free(map);
+	munmap(mem, (size_t)st.st_size);
+	return NULL;
+}
+
+/*
+ * Release the retired mappings of the index that no lookup can use and
+ * start a new epoch for the ones retired in the current one. Called by
+ * the thread doing the check.
+ */
+static void index_release(struct index *idx)
+{
+	struct idxmap **prev, *map;
+	uint32_t epoch;
+
+	/* the slot of the next epoch has only lookups older than the current */
+	epoch = __atomic_load_n(&idx->epoch, __ATOMIC_SEQ_CST);
+	if (!idx->retired || __atomic_load_n(&idx->users[(epoch + 1) & 1], __ATOMIC_SEQ_CST))
+		return;
+	for (prev = &idx->retired ; (map = *prev) ; )
+		if (map->epoch != epoch) {
+			*prev = map->next;
+			idxmap_close(map);
+		} else
+			prev = &map->next;
+	if (idx->retired)
+		__atomic_store_n(&idx->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Map again the file of the index if it changed. This is done at most
+ * once per second, by one thread at a time, the others don't wait.
+ */
+static void index_check(struct index *idx)
+{
+	struct timespec now;
+	struct stat st;
+	struct idxmap *map, *old;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (now.tv_sec < __atomic_load_n(&idx->next_check, __ATOMIC_RELAXED)
+	 || __atomic_exchange_n(&idx->busy, 1, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&idx->next_check, now.tv_sec + 1, __ATOMIC_RELAXED);
+
+	/* release the mappings replaced by the previous checks */
+	index_release(idx);
+
+	/* map again when the file changed */
+	get_config();
+	map = idx->current;
+	rc = stat(idx->path, &st);
+	if (rc ? !map : (map && map->dev == st.st_dev && map->ino == st.st_ino
+			&& map->mtime.tv_sec == st.st_mtim.tv_sec
+			&& map->mtime.tv_nsec == st.st_mtim.tv_nsec))
+		goto end;
+	map = rc ? NULL : idxmap_open(idx->path);
+	old = __atomic_exchange_n(&idx->current, map, __ATOMIC_SEQ_CST);
+	if (old) {
+		old->epoch = __atomic_load_n(&idx->epoch, __ATOMIC_SEQ_CST);
+		old->next = idx->retired;
+		idx->retired = old;
+		index_release(idx);
+	}
+end:
+	__atomic_store_n(&idx->busy, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start a lookup in the index: returns its current mapping, that stays
+ * valid until index_leave with the slot set in *slot, or NULL if there
+ * is none.
+ */
+static const struct idxmap *index_enter(struct index *idx, unsigned *slot)
+{
+	const struct idxmap *map;
+	uint32_t epoch;
+
+	index_check(idx);
+	if (!__atomic_load_n(&idx->current, __ATOMIC_RELAXED))
+		return NULL;
+
+	/* count the lookup in the slot of an epoch that didn't change */
+	do {
+		epoch = __atomic_load_n(&idx->epoch, __ATOMIC_SEQ_CST);
+		*slot = epoch & 1;
+		__atomic_add_fetch(&idx->users[*slot], 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&idx->epoch, __ATOMIC_SEQ_CST) == epoch)
+			break;
+		__atomic_sub_fetch(&idx->users[*slot], 1, __ATOMIC_RELEASE);
+	} while (1);
+
+	map = __atomic_load_n(&idx->current, __ATOMIC_SEQ_CST);
+	if (!map)
+		__atomic_sub_fetch(&idx->users[*slot], 1, __ATOMIC_RELEASE);
+	return map;
+}
+
+/* end a lookup in the index started in slot */
+static void index_leave(struct index *idx, unsigned slot)
+{
+	__atomic_sub_fetch(&idx->users[slot], 1, __ATOMIC_RELEASE);
+}
+
+/* forget the state of the checks and lookups of the other threads */
+static void index_reset(struct index *idx)
+{
+	idx->users[0] = 0;
+	idx->users[1] = 0;
+	idx->busy = 0;
+}
+
+/* reset the indexes in the child after fork */
+static void reset_indexes(void)
+{
+	index_reset(&apps_index);
+	index_reset(&users_index);
+}
+
+/* search the entry of the name of len chars */
+static const struct idxentry *index_find_name(const struct idxmap *map, const char *name, size_t len)
+{
+	const struct idxentry *ent;
+	const char *str;
+	uint64_t h;
+	size_t i;
+
+	h = hash_name(map->head->seed, name, len);
+	ent = &map->entries[hash_slot(h, map->disp[hash_bucket(h, map->head->nbuckets)],
+				      map->head->count)];
+	if (ent->len != len)
+		return NULL;
+	str = &map->names[ent->name];
+	for (i = 0 ; i < len ; i++)
+		if (str[i] != (name[i] | 0x20))
+			return NULL;
+	return ent;
+}
+
+#ifndef LOCALUSER_CODEC_ONLY
+/* search the entry of the id */
+static const struct idxentry *index_find_id(const struct idxmap *map, uint32_t id)
+{
+	uint32_t i;
+
+	i = id - map->head->base;
+	if (i >= map->head->span)
+		return NULL;
+	i = map->reverse[i];
+	return i == idx_none ? NULL : &map->entries[i];
+}
+#endif
+
+/* test if c is a char of names: letter, digit or, if dashes is set, dash */
+static int is_name_char(char c, int dashes)
+{
+	char l = c | 0x20;
+
+	return ('a' <= l && l <= 'z') || ('0' <= c && c <= '9') || (dashes && c == separator);
+}
+
+/*
+ * Read a name of the index idx: a letter followed by letters, digits or,
+ * if dashes is set, dashes, at most MAXNAMELEN chars, not ending with a
+ * dash. Returns its length if it is in the index, 0 if str isn't a name
+ * or -1 if the name isn't known.
+ */
+static int read_name(struct index *idx, const char *str, uint32_t *id, int dashes)
+{
+	const struct idxmap *map;
+	const struct idxentry *ent;
+	unsigned slot;
+	int len;
+	char c;
+
+	c = str[0] | 0x20;
+	if (c < 'a' || c > 'z')
+		return 0;
+	for (len = 1 ; len <= MAXNAMELEN && is_name_char(str[len], dashes) ; len++);
+	if (len > MAXNAMELEN || str[len - 1] == separator)
+		return -1;
+
+	map = index_enter(idx, &slot);
+	if (!map)
+		return -1;
+	ent = index_find_name(map, str, (size_t)len);
+	if (ent)
+		*id = ent->id;
+	index_leave(idx, slot);
+	return ent ? len : -1;
+}
+
+/*
+ * The keyword "app" stands for the application of the caller, whose name
+ * is found in its identity: its SMACK label or its cgroup, depending on
+ * the configuration. For example, the SMACK label "User::App::homescreen"
+ * gives the name "homescreen" whose APPID is then searched in the
+ * registry. The identity is read once per process.
+ */
+static const char appkeyword[] = "app";
+
+static struct
+{
+	pthread_once_t once;
+	uint32_t len;			/* length of the name or 0 if none */
+	char name[MAXNAMELEN + 1];	/* the name or the APPID in decimal */
+} self_app = { .once = PTHREAD_ONCE_INIT };
+
+/* test if str starts with the keyword "app", whatever is its case */
+static int is_app_keyword(const char *str)
+{
+	return !strncasecmp(str, appkeyword, sizeof appkeyword - 1)
+		&& !is_name_char(str[sizeof appkeyword - 1], 1);
+}
+
+/*
+ * Extract the name of the application from the identity of len chars:
+ * the prefix is removed and the name ends at the first '@', '.', ':' or
+ * double dash, as in "app-homescreen@1.service". The name, in lower case,
+ * is copied in name that must hold 1 + MAXNAMELEN chars. Returns its
+ * length or 0 if the identity doesn't give a valid name.
+ */
+static uint32_t app_of_identity(const char *ident, size_t len, const char *prefix, char *name)
+{
+	size_t plen, i;
+
+	plen = strlen(prefix);
+	if (len < plen || memcmp(ident, prefix, plen))
+		return 0;
+	ident += plen;
+	len -= plen;
+	for (i = 0 ; i < len && i <= MAXNAMELEN ; i++) {
+		if (ident[i] == '@' || ident[i] == '.' || ident[i] == ':'
+		 || (ident[i] == separator && i + 1 < len && ident[i + 1] == separator))
+			break;
+		if (!is_name_char(ident[i], 1))
+			return 0;
+		name[i] = (char)(ident[i] | 0x20);
+	}
+	if (!i || i > MAXNAMELEN || name[0] == separator || name[i - 1] == separator)
+		return 0;
+	name[i] = 0;
+	return (uint32_t)i;
+}
+
+/*
+ * Read the identity of the caller: its SMACK label, or the last component
+ * of its cgroup in the unified hierarchy, and extract the name of its
+ * application.
+ */
+static void read_self_app(void)
+{
+	char buffer[4096], *ident, *end;
+	const char *prefix;
+	ssize_t len;
+	int fd;
+
+	get_config();
+	if (config.app_source == app_smack) {
+		fd = open("/proc/self/attr/smack/current", O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			fd = open("/proc/self/attr/current", O_RDONLY | O_CLOEXEC);
+		prefix = "User::App::";
+	} else if (config.app_source == app_cgroup) {
+		fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+		prefix = "app-";
+	} else
+		return;
+	if (fd < 0)
+		return;
+	len = read(fd, buffer, sizeof buffer - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buffer[len] = 0;
+
+	if (config.app_source == app_smack)
+		ident = buffer;
+	else {
+		/* the line "0::PATH" of the unified hierarchy */
+		if (!strncmp(buffer, "0::", 3))
+			ident = &buffer[3];
+		else {
+			ident = strstr(buffer, "\n0::");
+			if (!ident)
+				return;
+			ident += 4;
+		}
+	}
+	end = &ident[strcspn(ident, "\n")];
+	*end = 0;
+	if (config.app_source == app_cgroup && strrchr(ident, '/'))
+		ident = strrchr(ident, '/') + 1;
+
+	if (config.app_prefix_set)
+		prefix = config.app_prefix;
+	self_app.len = app_of_identity(ident, strlen(ident), prefix, self_app.name);
+}
+
+/* get the APPID of the application of the caller, returns 1 or 0 if none */
+static int read_self_appid(uint32_t *appid)
+{
+	const struct idxmap *map;
+	const struct idxentry *ent;
+	unsigned slot;
+
+	pthread_once(&self_app.once, read_self_app);
+	if (!self_app.len)
+		return 0;
+	if (read_u32(self_app.name, appid) == (int)self_app.len)
+		return 1;
+	map = index_enter(&apps_index, &slot);
+	if (!map)
+		return 0;
+	ent = index_find_name(map, self_app.name, self_app.len);
+	if (ent)
+		*appid = ent->id;
+	index_leave(&apps_index, slot);
+	return ent != NULL;
+}
+
+/*
+ * Read the name of an application, see read_name, or the keyword "app"
+ * for the application of the caller.
+ */
+static int read_appname(const char *str, uint32_t *appid)
+{
+	if (is_app_keyword(str))
+		return read_self_appid(appid) ? (int)(sizeof appkeyword - 1) : -1;
+	return read_name(&apps_index, str, appid, 1);
+}
+
+/*
+ * Read the name of a user, see read_name. The names of users can't have
+ * dashes, that separate the APPID.
+ */
+static int read_username(const char *str, uint32_t *uid)
+{
+	return read_name(&users_index, str, uid, 0);
+}
+
+/* spelling of the ids of a name: names of the user and the application */
+struct ludnames
+{
+	unsigned explicit_uid: 1; /* write the UID even of the current user */
+	const char *user;	/* name of the user or NULL */
+	uint32_t userlen;	/* its length */
+	const char *app;	/* name of the application or NULL */
+	uint32_t applen;	/* its length */
+};
+
+/*
+ * Compute the length of the name of lud spelled as names, the canonical
+ * name if names is NULL. A name of user is always written.
+ */
+static uint32_t measure_name_as(const struct lud *lud, const struct ludnames *names)
+{
+	uint32_t i;
+
+	i = (uint32_t)(sizeof localuser - 1);
+	if (!lud->has_uid)
+		i += 2;
+	else if (names && names->user)
+		i += 1 + names->userlen;
+	else if (lud->uid != lud->me || (names && names->explicit_uid))
+		i += 1 + count_u32(lud->uid);
+	else if (lud->has_appid)
+		i += 1;
+	if (lud->has_appid)
+		i += 1 + (names && names->app ? names->applen : count_u32(lud->appid));
+	if (lud->replica)
+		i += 2;
+	return i;
+}
+
+/*
+ * In a user namespace, the UIDs seen by the processes aren't the ones of
+ * the host, so the addresses of distinct users of the host and of the
+ * containers would collide. When the configuration sets host-uid, the
+ * UIDs of the names are translated to the UIDs of the host for the
+ * addresses, and back for the reverse resolutions. The translation is
+ * made using the extents of /proc/self/uid_map, read once per process
+ * and sorted both ways for binary searches.
+ */
+#define MAXEXTENTS 340	/* maximum count of lines of uid_map */
+
+struct extent
+{
+	uint32_t first;		/* first UID in the namespace */
+	uint32_t lower;		/* first UID in the parent namespace */
+	uint32_t count;		/* count of UIDs */
+};
+
+static struct
+{
+	pthread_once_t once;
+	int identity;				/* the map is the identity */
+	unsigned count;				/* count of extents */
+	struct extent byns[MAXEXTENTS];		/* the extents by first */
+	struct extent byhost[MAXEXTENTS];	/* the extents by lower */
+} uid_map = { .once = PTHREAD_ONCE_INIT };
+
+static int cmp_extent_ns(const void *a, const void *b)
+{
+	uint32_t x = ((const struct extent*)a)->first, y = ((const struct extent*)b)->first;
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_extent_host(const void *a, const void *b)
+{
+	uint32_t x = ((const struct extent*)a)->lower, y = ((const struct extent*)b)->lower;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Read the extents of /proc/self/uid_map. Only the map of the initial
+ * namespace, "0 0 4294967295", is the identity: a map not yet written
+ * or unreadable maps nothing, the UIDs seen being then the overflow UID
+ * that would collide with the one of the host.
+ */
+static void read_uid_map(void)
+{
+	FILE *file;
+	struct extent ext;
+	unsigned n;
+
+	file = fopen("/proc/self/uid_map", "re");
+	if (!file)
+		return;
+	n = 0;
+	while (n < MAXEXTENTS && fscanf(file, "%u %u %u", &ext.first, &ext.lower, &ext.count) == 3)
+		uid_map.byns[n++] = ext;
+	fclose(file);
+	if (n == 1 && !ext.first && !ext.lower && ext.count == UINT32_MAX) {
+		uid_map.identity = 1;
+		return;
+	}
+	memcpy(uid_map.byhost, uid_map.byns, n * sizeof ext);
+	qsort(uid_map.byns, n, sizeof ext, cmp_extent_ns);
+	qsort(uid_map.byhost, n, sizeof ext, cmp_extent_host);
+	uid_map.count = n;
+}
+
+/*
+ * Translate uid by the n extents ext, sorted by first if to_host is set
+ * or by lower otherwise. Returns 0 if uid isn't mapped.
+ */
+static int map_uid(const struct extent *ext, unsigned n, int to_host, uint32_t uid, uint32_t *result)
+{
+	unsigned lo, hi, mid;
+	uint32_t from;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if ((to_host ? ext[mid].first : ext[mid].lower) <= uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return 0;
+	ext = &ext[lo - 1];
+	from = to_host ? ext->first : ext->lower;
+	if (uid - from >= ext->count)
+		return 0;
+	*result = (to_host ? ext->lower : ext->first) + (uid - from);
+	return 1;
+}
+
+/* translate the UID to the host if configured, returns 0 if not mapped */
+static int uid_to_host(uint32_t uid, uint32_t *hostuid)
+{
+	get_config();
+	if (config.host_uid) {
+		pthread_once(&uid_map.once, read_uid_map);
+		if (!uid_map.identity)
+			return map_uid(uid_map.byns, uid_map.count, 1, uid, hostuid);
+	}
+	*hostuid = uid;
+	return 1;
+}
+
+/* translate the UID of the host if configured, returns 0 if not mapped */
+static int uid_from_host(uint32_t hostuid, uint32_t *uid)
+{
+	get_config();
+	if (config.host_uid) {
+		pthread_once(&uid_map.once, read_uid_map);
+		if (!uid_map.identity)
+			return map_uid(uid_map.byhost, uid_map.count, 0, hostuid, uid);
+	}
+	*uid = hostuid;
+	return 1;
+}
+
+/* compute the length of the canonical name of lud */
+static void measure_name(struct lud *lud)
+{
+	lud->len = measure_name_as(lud, NULL);
+}
+
+/*
+ * Write the name of lud in name using names, see measure_name_as. The
+ * name must hold 1 + measure_name_as(lud, names) chars.
+ */
+static void encode_name_as(const struct lud *lud, char *name, const struct ludnames *names)
+{
+	unsigned i;
+
+	/* encode "localuser-" */
+	i = (unsigned)(sizeof localuser - 1);
+	memcpy(name, localuser, i);
+
+	/* encode the UID if needed */
+	if (!lud->has_uid) {
+		name[i++] = separator;
+		name[i++] = separator;
+	} else if (names && names->user) {
+		name[i++] = separator;
+		memcpy(&name[i], names->user, names->userlen);
+		i += names->userlen;
+	} else if (lud->uid != lud->me || (names && names->explicit_uid)) {
+		name[i++] = separator;
+		i += write_u32(&name[i], lud->uid);
+	} else if (lud->has_appid)
+		name[i++] = separator;
+
+	/* encode the APPID if needed */
+	if (lud->has_appid) {
+		name[i++] = separator;
+		if (names && names->app) {
+			memcpy(&name[i], names->app, names->applen);
+			i += names->applen;
+		} else
+			i += write_u32(&name[i], lud->appid);
+	}
+
+	/* encode the replica if needed */
+	if (lud->replica) {
+		name[i++] = '.';
+		name[i++] = (char)('0' + lud->replica);
+	}
+
+	/* finish */
+	name[i] = 0;
+}
+
+/* write the canonical name of lud in name that must hold 1 + lud->len chars */
+static void encode_name(const struct lud *lud, char *name)
+{
+	encode_name_as(lud, name, NULL);
+}
+
+/* compute the IPv4 address of lud, returns 0 if it has none */
+static int encode_ipv4(struct lud *lud)
+{
+	uint32_t adr;
+
+	if (lud->replica) {
+		/* case of a replica of UID and APPID */
+		if (!lud->has_uid
+		 || lud->hostuid > locusr_replica_uid_max
+		 || lud->appid > locusr_replica_appid_max)
+			return 0;
+		adr = (uint32_t)(locusr_replica_prefix
+				 | (lud->replica << locusr_replica_shift)
+				 | (lud->hostuid << locusr_replica_uid_shift)
+				 | lud->appid);
+	} else if (lud->has_appid && lud->has_uid) {
+		if (lud->appid <= locusr_both_ids_appid_max
+		 && lud->hostuid <= locusr_both_ids_uid_max) {
+			/* case of UID and APPID */
+			adr = (uint32_t)(locusr_both_ids_prefix
+					 | (lud->appid << locusr_both_ids_appid_shift)
+					 | lud->hostuid);
+		} else if (lud->appid <= locusr_large_uid_appid_max
+			&& lud->hostuid - locusr_large_uid_dynamic <= locusr_large_uid_uid_max) {
+			/* case of large UID of the window 0 and APPID */
+			adr = (uint32_t)(locusr_large_uid_prefix
+					 | ((lud->hostuid - locusr_large_uid_dynamic) << locusr_large_uid_uid_shift)
+					 | lud->appid);
+		} else if (lud->appid <= subuid_appid_max()
+			&& lud->hostuid - config.subuid <= subuid_uid_max()) {
+			/* case of large UID of the window 1 and APPID, whose
+			 * bits of APPID are configured */
+			adr = (uint32_t)(locusr_large_uid_prefix
+					 | locusr_large_uid_window
+					 | ((lud->hostuid - config.subuid) << config.subuid_appid_bits)
+					 | lud->appid);
+		} else
+			return 0;
+	} else if (lud->has_appid) {
+		/* case of only APPID */
+		if (lud->appid > locusr_appid_only_appid_max)
+			return 0;
+		adr = (uint32_t)(locusr_appid_only_prefix | lud->appid);
+	} else {
+		/* case of only UID */
+		if (lud->hostuid > locusr_uid_only_uid_max)
+			return 0;
+		adr = (uint32_t)(locusr_uid_only_prefix | lud->hostuid);
+	}
+	lud->ipv4 = htonl(adr);
+	return 1;
+}
 
-/* structure for coding/decoding */
-struct lud
+/*
+ * Test if lud has a native IPv6 address: the native mode is set and
+ * the ids fit. The value 0xffffffff, that isn't a valid UID, marks the
+ * missing ids in the native addresses so it can't be used as APPID.
+ * The replicas have no native address.
+ */
+static int has_native_ipv6(const struct lud *lud)
 {
-	unsigned has_uid: 1;	/* has a uid */
-	unsigned has_appid: 1;	/* has a appid */
-	uint32_t uid;		/* uid if any */
-	uint32_t appid;		/* appid if any */
-	uint32_t ipv4;		/* IPv4 representation */
-	uint32_t len;		/* name length */
-	char name[MAXNAMELEN];	/* name value */
-};
+	get_config();
+	return config.ipv6_native
+		&& !lud->replica
+		&& (!lud->has_uid || lud->hostuid != locusr_ipv6_none)
+		&& (!lud->has_appid || lud->appid != locusr_ipv6_none);
+}
 
-/* read a 32 bits integer. returns its length in character or -1 on overflow */
-static int read_u32(const char *str, uint32_t *val)
+/*
+ * Compute the addresses and the length of the name of lud whose ids, and
+ * the current UID if it has a UID, are set.
+ * Returns 1 or -2 when out of range.
+ */
+static int encode_lud(struct lud *lud)
 {
-	char c;
-	int p;
-	uint32_t a, b;
-
-	a = 0;
-	c = str[p = 0];
-	while ('0' <= c && c <= '9') {
-		b = (a << 3) + (a << 1) + (uint32_t)(c - '0');
-		if (b < a)
-			return -1; /* overflow */
-		a = b;
-		c = str[++p];
-	}
-	*val = a;
-	return p;
+	if (lud->has_uid && !uid_to_host(lud->uid, &lud->hostuid))
+		return -2;
+	lud->has_ipv4 = encode_ipv4(lud);
+	lud->ipv6_mapped = !has_native_ipv6(lud);
+	if (!lud->has_ipv4 && lud->ipv6_mapped)
+		return -2;
+
+	measure_name(lud);
+	return 1;
 }
 
-/* write a 32 bits integer and return the count of char writen */
-static unsigned write_u32(char *str, uint32_t val)
+/*
+ * Test if name starts with "localuser", ignoring the ASCII case. This is
+ * done for every name resolved on the host when localuser is first on the
+ * hosts line so it is made as cheap as possible: most names are rejected
+ * by their first character and the 8 first characters are compared at
+ * once when they are in the same page than the first one. Because the
+ * prefix is only made of letters, setting the bit 0x20 of each character
+ * lowers its case without changing the result of the comparison.
+ */
+static int match_prefix(const char *name)
 {
-	unsigned w, l, u;
-	char c;
+	uint64_t w, p;
 
-	l = w = 0;
-	while (val > 9) {
-		str[w++] = (char)('0' + val % 10);
-		val /= 10;
-	}
-	str[w++] = (char)('0' + val);
-	u = w;
-	while (--u > l) {
-		c = str[u];
-		str[u] = str[l];
-		str[l++] = c;
+	if ((name[0] | 0x20) != localuser[0])
+		return 0;
+	if (((uintptr_t)name & 4095) <= 4096 - sizeof w) {
+		memcpy(&w, name, sizeof w);
+		memcpy(&p, localuser, sizeof p);
+		return (w | 0x2020202020202020u) == p
+			&& (name[sizeof w] | 0x20) == localuser[sizeof w];
 	}
-	return w;
+	return strncasecmp(name, localuser, sizeof localuser - 1) == 0;
 }
 
-static void encode_name(struct lud *lud)
+/*
+ * Test if str is a valid end of a localuser name: either nothing, a
+ * single dot (fully qualified name) or a dot followed by one of the
+ * domains of the configuration, itself optionally followed by a dot.
+ */
+static int is_end(const char *str)
 {
 	unsigned i;
+	size_t len;
 
-	/* encode "localuser-" */
-	i = (int)(sizeof localuser - 1);
-	memcpy(lud->name, localuser, i);
-
-	/* encode the UID if needed */
-	if (!lud->has_uid) {
-		lud->name[i++] = separator;
-		lud->name[i++] = separator;
-	} else if (lud->uid != (uint32_t)getuid()) {
-		lud->name[i++] = separator;
-		i += write_u32(&lud->name[i], lud->uid);
-	} else if (lud->has_appid)
-		lud->name[i++] = separator;
-
-	/* encode the APPID if needed */
-	if (lud->has_appid) {
-		lud->name[i++] = separator;
-		i += write_u32(&lud->name[i], lud->appid);
+	if (!str[0])
+		return 1;
+	if (str[0] != '.')
+		return 0;
+	if (!*++str)
+		return 1;
+	get_config();
+	for (i = 0 ; i < config.ndomains ; i++) {
+		len = strlen(config.domains[i]);
+		if (!strncasecmp(str, config.domains[i], len)
+		 && (!str[len] || (str[len] == '.' && !str[len + 1])))
+			return 1;
 	}
+	return 0;
+}
 
-	/* finish */
-	lud->len = i;
-	lud->name[i] = 0;
+/* the current UID, kept in *known for the next calls */
+static uint32_t known_uid(uint64_t *known)
+{
+	if (!(*known & uid_cache_valid))
+		*known = uid_cache_valid | current_uid();
+	return (uint32_t)*known;
 }
 
 /*
- * Decode the name if valid and stores its ip in lud
- * Returns:
- *   - 0: not a localuser name
- *   - 1: valid local user name
- *   - -1: invalid localuser name
- *   - -2: out of range localuser name
+ * Decode the name starting with "localuser" whatever the case, as
+ * decode_name does, getting the current UID by known_uid
  */
-static int decode_name(const char *name, struct lud *lud)
+static int decode_matched_name(const char *name, struct lud *lud, uint64_t *known)
 {
-	int i, r;
-	uint32_t adr;
+	int i, r, cur;
 
-	/* test the prefix of the name */
 	i = (int)(sizeof localuser - 1);
-	if (strncmp(name, localuser, (size_t)i) != 0)
-		return 0;
 
 	/* prefix matches "localuser" */
-	if (!name[i]) {
+	cur = 0;
+	lud->replica = 0;
+	if (is_end(&name[i])) {
 		/* terminated string: "localuser" */
 		lud->has_uid = 1;
-		lud->uid = (uint32_t)getuid(); /* use current UID */
+		cur = 1; /* use current UID */
 		lud->has_appid = 0;
 	} else {
-		/* should be "localuser-..." */
+		/* should be "localuser-...", otherwise it isn't a localuser name */
 		if (name[i] != separator)
-			return -1;
+			return 0;
 		/* found "localuser-..." */
 		if (name[++i] == separator) {
 			/* found "localuser--..." */
@@ -244,16 +1524,23 @@ static int decode_name(const char *name, struct lud *lud)
 				lud->has_uid = 0;
 			} else {
 				/* found "localuser--x.." */
-				lud->uid = (uint32_t)getuid(); /* use current UID */
+				cur = 1; /* use current UID */
 				lud->has_uid = 1;
 			}
 			lud->has_appid = 1;
+		} else if (is_app_keyword(&name[i])) {
+			/* found "localuser-app...", short for "localuser--app..." */
+			cur = 1; /* use current UID */
+			lud->has_uid = 1;
+			lud->has_appid = 1;
 		} else {
 			/* found "localuser-X..." with X not being a dash */
 			r = read_u32(&name[i], &lud->uid);
+			if (r == 0)
+				r = read_username(&name[i], &lud->uid);
 			if (r <= 0)
 				return -1;
-			/* found "localuser-UID..." */
+			/* found "localuser-UID..." or "localuser-USER..." */
 			i += r;
 			lud->has_uid = 1;
 			if (name[i] != separator)
@@ -268,92 +1555,311 @@ static int decode_name(const char *name, struct lud *lud)
 		if (lud->has_appid) {
 			/* found "localuser-[UID|-]-..."  */
 			r = read_u32(&name[i], &lud->appid);
+			if (r == 0)
+				r = read_appname(&name[i], &lud->appid);
 			if (r <= 0)
 				return -1;
-			/* found "localuser-[UID|-]-APPID..."  */
+			/* found "localuser-[UID|-]-APPID..." or "localuser-[UID|-]-NAME..." */
 			i += r;
+			/* look for a replica number ".N" */
+			if (name[i] == '.' && '1' <= name[i + 1]
+			 && name[i + 1] <= (char)('0' + locusr_replica_max)
+			 && is_end(&name[i + 2])) {
+				lud->replica = (unsigned)(name[i + 1] - '0') & locusr_replica_mask_n;
+				i += 2;
+			}
 		}
-		/* the name should be finished now */
-		if (name[i])
+		/* the name should be finished now, maybe by a domain: any
+		   other suffix, a bad replica or a foreign domain, is invalid */
+		if (!is_end(&name[i]))
 			return -1;
 	}
 
-	/* encode the address */
-	if (lud->has_appid && lud->has_uid) {
-		/* case of UID and APPID */
-		if (lud->appid > locusr_both_ids_appid_max)
-			return -2;
-		if (lud->uid > locusr_both_ids_uid_max)
-			return -2;
-		adr = (uint32_t)(locusr_both_ids_prefix
-				 | (lud->appid << locusr_both_ids_appid_shift)
-				 | lud->uid);
-	} else if (lud->has_appid) {
-		/* case of only APPID */
-		if (lud->appid > locusr_appid_only_appid_max)
-			return -2;
-		adr = (uint32_t)(locusr_appid_only_prefix | lud->appid);
-	} else {
-		/* case of only UID */
-		if (lud->uid > locusr_uid_only_uid_max)
-			return -2;
-		adr = (uint32_t)(locusr_uid_only_prefix | lud->uid);
+	/* the current UID is only needed for valid names */
+	if (lud->has_uid) {
+		lud->me = known_uid(known);
+		if (cur)
+			lud->uid = lud->me;
 	}
-	lud->ipv4 = htonl(adr);
+	return encode_lud(lud);
+}
 
-	encode_name(lud);
-	return 1;
+/*
+ * Decode the name if valid and stores its ip in lud
+ * Returns:
+ *   - 0: not a localuser name
+ *   - 1: valid local user name
+ *   - -1: invalid localuser name
+ *   - -2: out of range localuser name
+ */
+static int decode_name(const char *name, struct lud *lud)
+{
+	uint64_t known = 0;
+
+	return match_prefix(name) ? decode_matched_name(name, lud, &known) : 0;
+}
+
+/* kind of the IPv4 address adr given in host order */
+static enum localuser_kind classify_ipv4(uint32_t adr)
+{
+	if ((adr & prefix_mask) != prefix_value)
+		return LOCALUSER_KIND_NONE;
+	if ((adr & locusr_both_ids_mask) == locusr_both_ids_prefix)
+		return LOCALUSER_KIND_BOTH;
+	if ((adr & locusr_appid_only_mask) == locusr_appid_only_prefix)
+		return LOCALUSER_KIND_APPID;
+	if ((adr & locusr_uid_only_mask) == locusr_uid_only_prefix)
+		return LOCALUSER_KIND_UID;
+	if ((adr & locusr_large_uid_mask) == locusr_large_uid_prefix)
+		return LOCALUSER_KIND_LARGE_UID;
+	if ((adr & locusr_replica_mask) == locusr_replica_prefix
+	 && ((adr >> locusr_replica_shift) & locusr_replica_mask_n))
+		return LOCALUSER_KIND_REPLICA;
+	return LOCALUSER_KIND_RESERVED;
 }
 
 /*
- * Decode the ipv4 if valid and stores its data in lud
+ * Decode the ids of the ipv4 if valid and stores them in lud, without
+ * the current UID and the length of the name
  * Returns:
  *   - 0: not a localuser ip
  *   - 1: valid local user ip
  *   - -1: invalid localuser ip
  */
-static int decode_ipv4(uint32_t ipv4, struct lud *lud)
+static int decode_ipv4_ids(uint32_t ipv4, struct lud *lud)
 {
 	uint32_t adr;
 
 	/* check the address range */
 	adr = ntohl(ipv4);
-	if ((adr & prefix_mask) != prefix_value)
-		return 0;
-
-	/* decode */
 	lud->ipv4 = ipv4;
-	if ((adr & locusr_both_ids_mask) == locusr_both_ids_prefix) {
+	lud->has_ipv4 = 1;
+	lud->ipv6_mapped = 1;
+	lud->replica = 0;
+	switch (classify_ipv4(adr)) {
+	case LOCALUSER_KIND_NONE:
+		return 0;
+	case LOCALUSER_KIND_BOTH:
 		lud->has_uid = 1;
 		lud->has_appid = 1;
-		lud->uid = adr & locusr_both_ids_uid_mask;
-		if (lud->uid > locusr_both_ids_uid_max)
+		lud->hostuid = adr & locusr_both_ids_uid_mask;
+		if (lud->hostuid > locusr_both_ids_uid_max)
 			return -1;
 		lud->appid = (adr >> locusr_both_ids_appid_shift) & locusr_both_ids_appid_mask;
 		if (lud->appid > locusr_both_ids_appid_max)
 			return -1;
-	} else  if ((adr & locusr_appid_only_mask) == locusr_appid_only_prefix) {
+		break;
+	case LOCALUSER_KIND_APPID:
 		lud->has_uid = 0;
 		lud->has_appid = 1;
 		lud->appid = adr & locusr_appid_only_appid_mask;
 		if (lud->appid > locusr_appid_only_appid_max)
 			return -1;
-	} else if ((adr & locusr_uid_only_mask) == locusr_uid_only_prefix) {
+		break;
+	case LOCALUSER_KIND_UID:
 		lud->has_uid = 1;
 		lud->has_appid = 0;
-		lud->uid = adr & locusr_uid_only_uid_mask;
-		if (lud->uid > locusr_uid_only_uid_max)
+		lud->hostuid = adr & locusr_uid_only_uid_mask;
+		if (lud->hostuid > locusr_uid_only_uid_max)
 			return -1;
-	} else {
+		break;
+	case LOCALUSER_KIND_LARGE_UID:
+		lud->has_uid = 1;
+		lud->has_appid = 1;
+		get_config();
+		if (adr & locusr_large_uid_window) {
+			lud->hostuid = config.subuid
+				+ ((adr & (locusr_large_uid_window - 1)) >> config.subuid_appid_bits);
+			lud->appid = adr & subuid_appid_max();
+			break;
+		}
+		lud->hostuid = (adr >> locusr_large_uid_uid_shift) & locusr_large_uid_uid_mask;
+		if (lud->hostuid > locusr_large_uid_uid_max)
+			return -1;
+		lud->hostuid += locusr_large_uid_dynamic;
+		lud->appid = adr & locusr_large_uid_appid_mask;
+		if (lud->appid > locusr_large_uid_appid_max)
+			return -1;
+		break;
+	case LOCALUSER_KIND_REPLICA:
+		lud->has_uid = 1;
+		lud->has_appid = 1;
+		lud->replica = (adr >> locusr_replica_shift) & locusr_replica_mask_n;
+		if (lud->replica > locusr_replica_max)
+			return -1;
+		lud->hostuid = (adr >> locusr_replica_uid_shift) & locusr_replica_uid_mask;
+		if (lud->hostuid > locusr_replica_uid_max)
+			return -1;
+		lud->appid = adr & locusr_replica_appid_mask;
+		if (lud->appid > locusr_replica_appid_max)
+			return -1;
+		break;
+	default:
 		/* reserved address */
 		return -1;
 	}
 
-	encode_name(lud);
+	/* the address has the UID of the host */
+	if (lud->has_uid && !uid_from_host(lud->hostuid, &lud->uid))
+		return -1;
+	return 1;
+}
+
+/*
+ * Decode the ids of the native ipv6 if valid and stores them in lud,
+ * without the current UID and the length of the name
+ * Returns:
+ *   - 0: not a localuser ip
+ *   - 1: valid local user ip
+ *   - -1: invalid localuser ip
+ */
+static int decode_ipv6_ids(const uint32_t *bufip, struct lud *lud)
+{
+	get_config();
+	if (!config.ipv6_native || memcmp(bufip, config.ipv6_prefix, sizeof config.ipv6_prefix))
+		return 0;
+
+	lud->hostuid = ntohl(bufip[2]);
+	lud->appid = ntohl(bufip[3]);
+	lud->has_uid = lud->hostuid != locusr_ipv6_none;
+	lud->has_appid = lud->appid != locusr_ipv6_none;
+	if (!lud->has_uid && !lud->has_appid)
+		return -1;
+	if (lud->has_uid && !uid_from_host(lud->hostuid, &lud->uid))
+		return -1;
+	lud->replica = 0;
+	lud->has_ipv4 = encode_ipv4(lud);
+	lud->ipv6_mapped = 0;
 	return 1;
 }
 
-/* fill the output entry */
+/* put the IPv6 address of lud in bufip: native or IPv4-mapped */
+static void encode_ipv6(uint32_t *bufip, const struct lud *lud)
+{
+	if (lud->ipv6_mapped) {
+		bufip[0] = 0;
+		bufip[1] = 0;
+		bufip[2] = htonl(0xffff);
+		bufip[3] = lud->ipv4;
+	} else {
+		memcpy(bufip, config.ipv6_prefix, sizeof config.ipv6_prefix);
+		bufip[2] = htonl(lud->has_uid ? lud->hostuid : locusr_ipv6_none);
+		bufip[3] = htonl(lud->has_appid ? lud->appid : locusr_ipv6_none);
+	}
+}
+
+/* the decoders and entries of NSS, left out of the codec of liblocaluser */
+#ifndef LOCALUSER_CODEC_ONLY
+
+/*
+ * Decode the ipv4 if valid and stores its data in lud
+ * Returns:
+ *   - 0: not a localuser ip
+ *   - 1: valid local user ip
+ *   - -1: invalid localuser ip
+ */
+static int decode_ipv4(uint32_t ipv4, struct lud *lud)
+{
+	int rc = decode_ipv4_ids(ipv4, lud);
+
+	if (rc == 1) {
+		lud->me = current_uid();
+		measure_name(lud);
+	}
+	return rc;
+}
+
+/*
+ * Decode the native ipv6 if valid and stores its data in lud
+ * Returns:
+ *   - 0: not a localuser ip
+ *   - 1: valid local user ip
+ *   - -1: invalid localuser ip
+ */
+static int decode_ipv6(const uint32_t *bufip, struct lud *lud)
+{
+	int rc = decode_ipv6_ids(bufip, lud);
+
+	if (rc == 1) {
+		if (lud->has_uid)
+			lud->me = current_uid();
+		measure_name(lud);
+	}
+	return rc;
+}
+
+/*
+ * Result of lookups of names or addresses that don't exist. rc is the
+ * code returned by decode_name or decode_ipv4: 0 when not a name or an
+ * address of localuser, negative when invalid, out of range or reserved.
+ *
+ * In authoritative mode, the invalid localuser names and addresses
+ * return the status NSS_STATUS_UNAVAIL, with h_errno set to HOST_NOT_FOUND.
+ * Otherwise, this status is only returned for localuser names asked with
+ * an unsupported family. Setting "localuser [UNAVAIL=return]" on the
+ * hosts line then stops the lookup of these names and addresses, while
+ * the other names continue to the next services.
+ */
+static enum nss_status not_found(int rc, int *errnop, int *h_errnop)
+{
+	*h_errnop = HOST_NOT_FOUND;
+	if (rc < 0) {
+		get_config();
+		if (config.authoritative) {
+			*errnop = ENOENT;
+			return NSS_STATUS_UNAVAIL;
+		}
+	}
+	return NSS_STATUS_NOTFOUND;
+}
+
+/*
+ * Compute the spellings of lud other than its canonical name: the UID
+ * is given as the current user (short form), in decimal or by the name
+ * of the user, the APPID in decimal or by the name of the application.
+ * Returns their count, at most 5.
+ */
+static unsigned alias_forms(const struct lud *lud, const struct ludnames *names,
+			    struct ludnames *forms)
+{
+	struct ludnames uforms[3];
+	unsigned nu, na, a, u, n;
+
+	/* the spellings of the UID, the canonical one first */
+	nu = 0;
+	memset(uforms, 0, sizeof uforms);
+	if (!lud->has_uid)
+		nu++;
+	else {
+		if (lud->uid == lud->me)
+			nu++;
+		uforms[nu++].explicit_uid = 1;
+		if (names->user) {
+			uforms[nu].user = names->user;
+			uforms[nu++].userlen = names->userlen;
+		}
+	}
+
+	/* combined with the spellings of the APPID, except the canonical one */
+	n = 0;
+	na = lud->has_appid && names->app ? 2 : 1;
+	for (a = 0 ; a < na ; a++)
+		for (u = a ? 0 : 1 ; u < nu ; u++) {
+			forms[n] = uforms[u];
+			if (a) {
+				forms[n].app = names->app;
+				forms[n].applen = names->applen;
+			}
+			n++;
+		}
+	return n;
+}
+
+/*
+ * Fill the output entry. The other spellings of the name are given as
+ * aliases, using the names of the user and of the application found in
+ * the indexes, so that callers don't have to resolve them again.
+ */
 static enum nss_status fillent(
 	struct lud *lud,
 	int af,
@@ -363,13 +1869,23 @@ static enum nss_status fillent(
 	int *errnop,
 	int *h_errnop)
 {
+	const struct idxmap *umap, *amap;
+	const struct idxentry *user, *app;
+	struct ludnames names, forms[5];
+	enum nss_status status;
+	unsigned uslot, aslot;
 	uint32_t *bufip;
-	int len, alen;
+	char *str;
+	int len;
+	size_t size;
+	unsigned i, n;
 
 	/* check the family */
-	if (af == AF_INET)
+	if (af == AF_INET) {
+		if (!lud->has_ipv4)
+			return not_found(-2, errnop, h_errnop);
 		len = lenip4;
-	else if (af == AF_INET6)
+	} else if (af == AF_INET6)
 		len = lenip6;
 	else {
 		*errnop = EINVAL;
@@ -377,35 +1893,143 @@ static enum nss_status fillent(
 		return NSS_STATUS_UNAVAIL;
 	}
 
-	/* fill aliases and addr_list */
-	alen = 1 + lud->len;
-	if (buflen < (2 * sizeof result->h_aliases[0]) + alen + len) {
+	/* search the names of the user and of the application */
+	umap = lud->has_uid ? index_enter(&users_index, &uslot) : NULL;
+	user = umap ? index_find_id(umap, lud->uid) : NULL;
+	amap = lud->has_appid ? index_enter(&apps_index, &aslot) : NULL;
+	app = amap ? index_find_id(amap, lud->appid) : NULL;
+	memset(&names, 0, sizeof names);
+	if (user) {
+		names.user = &umap->names[user->name];
+		names.userlen = user->len;
+	}
+	if (app) {
+		names.app = &amap->names[app->name];
+		names.applen = app->len;
+	}
+	n = alias_forms(lud, &names, forms);
+
+	/* check the size for addr_list, aliases, address, name and aliases */
+	size = (n ? 3 + n : 2) * sizeof result->h_aliases[0] + (size_t)len + 1 + lud->len;
+	for (i = 0 ; i < n ; i++)
+		size += 1 + measure_name_as(lud, &forms[i]);
+	if (buflen < size) {
 		*errnop = ERANGE;
 		*h_errnop = NO_RECOVERY;
-		return NSS_STATUS_TRYAGAIN;
+		status = NSS_STATUS_TRYAGAIN;
+		goto end;
 	}
 
 	/* fill the result */
 	result->h_addrtype = af;
 	result->h_length = len;
 	result->h_addr_list = (char**)buffer;
-	result->h_addr_list[0] = (char*)&result->h_addr_list[2];
-	result->h_name = &result->h_addr_list[0][len];
-	memcpy(result->h_name, lud->name, alen);
-	result->h_aliases = &result->h_addr_list[1];
 	result->h_addr_list[1] = NULL;
+	result->h_aliases = &result->h_addr_list[n ? 2 : 1];
+	result->h_addr_list[0] = (char*)&result->h_aliases[n + 1];
+	result->h_name = &result->h_addr_list[0][len];
+	encode_name(lud, result->h_name);
+	str = &result->h_name[1 + lud->len];
+	for (i = 0 ; i < n ; i++) {
+		result->h_aliases[i] = str;
+		encode_name_as(lud, str, &forms[i]);
+		str += 1 + strlen(str);
+	}
+	result->h_aliases[n] = NULL;
 	bufip = (uint32_t*)result->h_addr_list[0];
-	if (af == AF_INET6) {
-		*bufip++ = 0;
-		*bufip++ = 0;
-		*bufip++ = htonl(0xffff);
+	if (af == AF_INET6)
+		encode_ipv6(bufip, lud);
+	else
+		*bufip = lud->ipv4;
+	status = NSS_STATUS_SUCCESS;
+
+end:
+	if (umap)
+		index_leave(&users_index, uslot);
+	if (amap)
+		index_leave(&apps_index, aslot);
+	return status;
+}
+
+/*
+ * gethostbyname3 implementation for NSS
+ *
+ * The answers never change for a given name: the time to live given
+ * to caching layers (like nscd) is the one of the configuration, very
+ * long by default. The canonical name is the one computed by encode_name.
+ */
+enum nss_status _nss_localuser_gethostbyname3_r(
+	const char *name,
+	int af,
+	struct hostent *result,
+	char *buffer,
+	size_t buflen,
+	int *errnop,
+	int *h_errnop,
+	int32_t *ttlp,
+	char **canonp)
+{
+	struct lud lud;
+	enum nss_status status;
+	int rc;
+
+	/* decode the name */
+	rc = decode_name(name, &lud);
+	if (rc <= 0)
+		return not_found(rc, errnop, h_errnop);
+
+	/* set default family to IPv4 */
+	if (af == AF_UNSPEC)
+		af = AF_INET;
+
+	/* fill the result */
+	status = fillent(&lud, af, result, buffer, buflen, errnop, h_errnop);
+	if (status == NSS_STATUS_SUCCESS) {
+		if (ttlp) {
+			get_config();
+			*ttlp = config.ttl;
+		}
+		if (canonp)
+			*canonp = result->h_name;
 	}
-	*bufip = lud->ipv4;
+	return status;
+}
+
+/*
+ * getcanonname implementation for NSS
+ *
+ * Used by getaddrinfo when AI_CANONNAME is set. It returns the name
+ * computed by encode_name, for example "localuser--78" for the user 1001
+ * asking "localuser-1001-78", without building a hostent.
+ */
+enum nss_status _nss_localuser_getcanonname_r(
+	const char *name,
+	char *buffer,
+	size_t buflen,
+	char **result,
+	int *errnop,
+	int *h_errnop)
+{
+	struct lud lud;
+	int rc;
 
+	/* decode the name */
+	rc = decode_name(name, &lud);
+	if (rc <= 0)
+		return not_found(rc, errnop, h_errnop);
+
+	/* copy the canonical name */
+	if (buflen < 1 + lud.len) {
+		*errnop = ERANGE;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	encode_name(&lud, buffer);
+	*result = buffer;
 	return NSS_STATUS_SUCCESS;
 }
 
-/* gethostbyname2 implementation for NSS */
+/* use gethostbyname3 implementation */
 enum nss_status _nss_localuser_gethostbyname2_r(
 	const char *name,
 	int af,
@@ -414,21 +2038,79 @@ enum nss_status _nss_localuser_gethostbyname2_r(
 	size_t buflen,
 	int *errnop,
 	int *h_errnop)
+{
+	return _nss_localuser_gethostbyname3_r(name, af,
+					       result,
+					       buffer, buflen, errnop,
+					       h_errnop, NULL, NULL);
+}
+
+/*
+ * gethostbyname4 implementation for NSS
+ *
+ * This is the entry used by getaddrinfo for AF_UNSPEC requests. Answering
+ * it avoids the two calls to gethostbyname2 and, when only one tuple is
+ * returned, the sorting of addresses of RFC 3484 that glibc does on the
+ * merged list. The families returned are set by the key "unspec" of the
+ * configuration.
+ */
+enum nss_status _nss_localuser_gethostbyname4_r(
+	const char *name,
+	struct gaih_addrtuple **pat,
+	char *buffer,
+	size_t buflen,
+	int *errnop,
+	int *h_errnop,
+	int32_t *ttlp)
 {
 	struct lud lud;
+	struct gaih_addrtuple *tuples;
+	size_t pad, count, need;
+	unsigned i;
+	int rc;
 
 	/* decode the name */
-	if (decode_name(name, &lud) <= 0) {
-		*h_errnop = HOST_NOT_FOUND;
-		return NSS_STATUS_NOTFOUND;
+	rc = decode_name(name, &lud);
+	if (rc <= 0)
+		return not_found(rc, errnop, h_errnop);
+
+	/* check the available size */
+	get_config();
+	count = lud.has_ipv4 && config.unspec == unspec_both ? 2 : 1;
+	pad = -(uintptr_t)buffer % __alignof__(struct gaih_addrtuple);
+	need = pad + count * sizeof *tuples + 1 + lud.len;
+	if (buflen < need) {
+		*errnop = ERANGE;
+		*h_errnop = NO_RECOVERY;
+		return NSS_STATUS_TRYAGAIN;
 	}
 
-	/* set default family to IPv4 */
-	if (af == AF_UNSPEC)
-		af = AF_INET;
+	/* fill the tuples */
+	tuples = (struct gaih_addrtuple*)&buffer[pad];
+	memset(tuples, 0, count * sizeof *tuples);
+	encode_name(&lud, (char*)&tuples[count]);
+	for (i = 0 ; i < count ; i++) {
+		tuples[i].name = (char*)&tuples[count];
+		if (i || !lud.has_ipv4 || config.unspec == unspec_inet6) {
+			tuples[i].family = AF_INET6;
+			encode_ipv6(tuples[i].addr, &lud);
+		} else {
+			tuples[i].family = AF_INET;
+			tuples[i].addr[0] = lud.ipv4;
+		}
+		if (i)
+			tuples[i - 1].next = &tuples[i];
+	}
 
-	/* fill the result */
-	return fillent(&lud, af, result, buffer, buflen, errnop, h_errnop);
+	/* the first tuple may be given by the caller */
+	if (*pat)
+		**pat = *tuples;
+	else
+		*pat = tuples;
+
+	if (ttlp)
+		*ttlp = config.ttl;
+	return NSS_STATUS_SUCCESS;
 }
 
 /* use gethostbyname2 implementation */
@@ -460,7 +2142,7 @@ enum nss_status _nss_localuser_gethostbyaddr_r(
 {
 	struct lud lud;
 	const uint32_t *bufip = (const uint32_t*)addr;
-	int check;
+	int check, rc;
 
 	/* set default family */
 	if (af == AF_UNSPEC) {
@@ -471,15 +2153,21 @@ enum nss_status _nss_localuser_gethostbyaddr_r(
 	}
 
 	/* pre process of ipv6 */
-	if (af == AF_INET6 && len == lenip6)
-		check = (*bufip++ == 0 && *bufip++ == 0 && *bufip++ == htonl(0xffff));
-	else
+	if (af == AF_INET6 && len == lenip6) {
+		check = (bufip[0] == 0 && bufip[1] == 0 && bufip[2] == htonl(0xffff));
+		rc = check ? decode_ipv4(bufip[3], &lud) : decode_ipv6(bufip, &lud);
+	} else {
 		check = (af == AF_INET && len == lenip4);
+		rc = check ? decode_ipv4(*bufip, &lud) : 0;
+	}
 
-	if (check && decode_ipv4(*bufip, &lud) == 1)
+	if (rc == 1)
 		return fillent(&lud, af, result, buffer, buflen, errnop, h_errnop);
+	if (rc < 0)
+		return not_found(rc, errnop, h_errnop);
 
 	*errnop = EINVAL;
 	*h_errnop = NO_RECOVERY;
 	return NSS_STATUS_NOTFOUND;
 }
+#endif
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * localuser.h
+ * -----------
+ *  Interface of the library liblocaluser, companion of the NSS module
+ *  libnss_localuser.so.2.
+ *
+ *  The library gives the encoding of the names and addresses of localuser
+ *  without going through NSS: it is built on the code of the module. None
+ *  of its functions allocates memory.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* results of the functions of the codec */
+#define LOCALUSER_OK            1	/* valid name or address */
+#define LOCALUSER_NOT_LOCALUSER 0	/* not a name or an address of localuser */
+#define LOCALUSER_INVALID       (-1)	/* invalid or reserved */
+#define LOCALUSER_OUT_OF_RANGE  (-2)	/* valid but without address */
+
+/* flags of struct localuser_id */
+#define LOCALUSER_UID   1	/* the UID is given */
+#define LOCALUSER_APPID 2	/* the APPID is given */
+
+/* size of a buffer receiving any canonical name, with its final zero */
+#define LOCALUSER_NAME_SIZE 34
+
+/* identity of a name or an address of localuser */
+struct localuser_id
+{
+	unsigned flags;		/* LOCALUSER_UID and/or LOCALUSER_APPID */
+	uint32_t uid;		/* the UID when LOCALUSER_UID */
+	uint32_t appid;		/* the APPID when LOCALUSER_APPID */
+	unsigned replica;	/* the replica from 1 to 3, or 0 */
+};
+
+/* kinds of the IPv4 addresses */
+enum localuser_kind
+{
+	LOCALUSER_KIND_NONE,		/* not in 127.128.0.0/9 */
+	LOCALUSER_KIND_BOTH,		/* UID and APPID */
+	LOCALUSER_KIND_APPID,		/* APPID only */
+	LOCALUSER_KIND_UID,		/* UID only */
+	LOCALUSER_KIND_LARGE_UID,	/* large UID and APPID */
+	LOCALUSER_KIND_REPLICA,		/* replica of UID and APPID */
+	LOCALUSER_KIND_RESERVED		/* reserved address */
+};
+
+/*
+ * Parse the name as the NSS module does and store its identity in id,
+ * the current UID when the name doesn't give it. The names of users and
+ * applications are looked up in the indexes of the configuration.
+ *
+ * Returns LOCALUSER_OK, LOCALUSER_NOT_LOCALUSER, LOCALUSER_INVALID or
+ * LOCALUSER_OUT_OF_RANGE.
+ */
+extern int localuser_parse_name(const char *name, struct localuser_id *id);
+
+/*
+ * Write the canonical name of id in buffer of size bytes, truncated but
+ * terminated as snprintf does.
+ *
+ * Returns the length of the name without its final zero, or 0 when id
+ * is invalid.
+ */
+extern size_t localuser_format_name(const struct localuser_id *id, char *buffer, size_t size);
+
+/* Returns the kind of the IPv4 address addr given in network order */
+extern enum localuser_kind localuser_classify_ipv4(uint32_t addr);
+
+/*
+ * Decode the IPv4 address addr given in network order in id.
+ *
+ * Returns LOCALUSER_OK, LOCALUSER_NOT_LOCALUSER or LOCALUSER_INVALID.
+ */
+extern int localuser_decode_ipv4(uint32_t addr, struct localuser_id *id);
+
+/*
+ * Store in addr the IPv4 address of id in network order.
+ *
+ * Returns LOCALUSER_OK, LOCALUSER_INVALID or LOCALUSER_OUT_OF_RANGE.
+ */
+extern int localuser_encode_ipv4(const struct localuser_id *id, uint32_t *addr);
+
+/*
+ * Decode the IPv6 address addr, native or IPv4-mapped, in id.
+ *
+ * Returns LOCALUSER_OK, LOCALUSER_NOT_LOCALUSER or LOCALUSER_INVALID.
+ */
+extern int localuser_decode_ipv6(const struct in6_addr *addr, struct localuser_id *id);
+
+/*
+ * Store in addr the IPv6 address of id, native or IPv4-mapped as the
+ * configuration tells.
+ *
+ * Returns LOCALUSER_OK, LOCALUSER_INVALID or LOCALUSER_OUT_OF_RANGE.
+ */
+extern int localuser_encode_ipv6(const struct localuser_id *id, struct in6_addr *addr);
+
+/*
+ * Resolve the count names of names as localuser_parse_name and then
+ * localuser_encode_ipv4 do. For each name, store the status in status
+ * and the IPv4 address in network order, or 0, in addrs. The prefixes
+ * of several names are matched at once using SIMD when available: the
+ * names that aren't of localuser cost a few nanoseconds. They are left
+ * to the caller, with the status LOCALUSER_NOT_LOCALUSER.
+ *
+ * Returns the count of names resolved, whose status is LOCALUSER_OK.
+ */
+extern size_t localuser_resolve_names(const char *const *names, size_t count,
+				      uint32_t *addrs, int *status);
+
+/*
+ * Classify the count IPv4 addresses of addrs, given in network order,
+ * as localuser_decode_ipv4 does. For each address, store its kind (an
+ * enum localuser_kind) in kinds, its UID in uids and its APPID in
+ * appids, 0 when it has none. The invalid addresses, including the
+ * ones whose UID isn't mapped in the user namespace, are of the kind
+ * LOCALUSER_KIND_RESERVED. The addresses are processed 8 or 4 at once
+ * using AVX2 or SSE4.1 when available.
+ *
+ * Returns the count of valid addresses of localuser.
+ */
+extern size_t localuser_classify_ipv4s(const uint32_t *addrs, size_t count,
+				       uint32_t *uids, uint32_t *appids, uint8_t *kinds);
+
+/*
+ * Connect the socket sockfd to the address addr of length addrlen, as
+ * connect(2) does. When addr is an IPv4 (or IPv4-mapped IPv6) address
+ * of the loopback, the socket is first bound to the address of
+ * "localuser" (the current user) without choosing the port
+ * (IP_BIND_ADDRESS_NO_PORT), so that the server sees who connects and
+ * the ephemeral ports aren't shared with 127.0.0.1.
+ *
+ * Returns 0 on success or -1 with errno set on error.
+ */
+extern int localuser_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * Same as localuser_connect but the socket is bound to the address of
+ * "localuser--APPID" and of its replicas "localuser--APPID.N", each
+ * call using the next of them, multiplying the count of connections
+ * that can be opened by the application.
+ */
+extern int localuser_connect_app(int sockfd, const struct sockaddr *addr, socklen_t addrlen, uint32_t appid);
+
+#ifdef __cplusplus
+}
+#endif
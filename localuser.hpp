@@ -0,0 +1,448 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * localuser.hpp
+ * -------------
+ *  Header only C++17 companion of localuser.h: the names and IPv4
+ *  addresses of localuser computed at compile time or at run time
+ *  without allocation.
+ *
+ *  The layout of the addresses is the one of localuser.c, whose
+ *  constants are repeated below. test-cxx checks that both agree on
+ *  all the addresses of 127.128.0.0/9.
+ *
+ *  The addresses are in host order, to_network giving the network
+ *  order. The UIDs are the ones of the host: unlike the module, nothing
+ *  here reads the configuration, the indexes of names or the map of
+ *  UIDs of a user namespace. The window of the subordinated UIDs is
+ *  given by the parameter subuid and its bits of APPID by appid_bits,
+ *  the defaults of the configuration by default. The parser only
+ *  accepts numbers, without domain, and tells out of range the names
+ *  without IPv4 address.
+ *
+ *  example:
+ *
+ *    constexpr auto app = localuser::user_app(1001, 42);
+ *    static_assert(localuser::ipv4_of(app) == 0x7fc153e9);
+ *    constexpr auto name = localuser::name_of(app, 0);
+ *    puts(name.data); // localuser-1001-42
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <charconv>
+#include <string_view>
+
+#include "localuser.h"
+
+namespace localuser {
+
+using identity = ::localuser_id;
+using kind = ::localuser_kind;
+
+/* masks for IPv4 adresses, as in localuser.c */
+inline constexpr std::uint32_t prefix_mask  = 0xff800000u; /* 255.128.0.0 */
+inline constexpr std::uint32_t prefix_value = 0x7f800000u; /* 127.128.0.0 */
+
+inline constexpr std::uint32_t locusr_both_ids_mask         = 0x7fc00000u;
+inline constexpr std::uint32_t locusr_both_ids_prefix       = 0x7fc00000u;
+inline constexpr std::uint32_t locusr_both_ids_uid_max      = 0x000007ffu;
+inline constexpr std::uint32_t locusr_both_ids_uid_mask     = 0x000007ffu;
+inline constexpr std::uint32_t locusr_both_ids_appid_max    = 0x000007ffu;
+inline constexpr std::uint32_t locusr_both_ids_appid_mask   = 0x000007ffu;
+inline constexpr std::uint8_t  locusr_both_ids_appid_shift  = 11;
+
+inline constexpr std::uint32_t locusr_appid_only_mask       = 0x7ff00000u;
+inline constexpr std::uint32_t locusr_appid_only_prefix     = 0x7fb00000u;
+inline constexpr std::uint32_t locusr_appid_only_appid_max  = 0x000fffffu;
+inline constexpr std::uint32_t locusr_appid_only_appid_mask = 0x000fffffu;
+
+inline constexpr std::uint32_t locusr_uid_only_mask         = 0x7ff00000u;
+inline constexpr std::uint32_t locusr_uid_only_prefix       = 0x7fa00000u;
+inline constexpr std::uint32_t locusr_uid_only_uid_max      = 0x000fffffu;
+inline constexpr std::uint32_t locusr_uid_only_uid_mask     = 0x000fffffu;
+
+inline constexpr std::uint32_t locusr_large_uid_mask        = 0x7ff00000u;
+inline constexpr std::uint32_t locusr_large_uid_prefix      = 0x7f800000u;
+inline constexpr std::uint32_t locusr_large_uid_window      = 0x00080000u;
+inline constexpr std::uint32_t locusr_large_uid_uid_max     = 0x00001fffu;
+inline constexpr std::uint32_t locusr_large_uid_uid_mask    = 0x00001fffu;
+inline constexpr std::uint8_t  locusr_large_uid_uid_shift   = 6;
+inline constexpr std::uint32_t locusr_large_uid_appid_max   = 0x0000003fu;
+inline constexpr std::uint32_t locusr_large_uid_appid_mask  = 0x0000003fu;
+inline constexpr std::uint32_t locusr_large_uid_dynamic     = 61184;  /* systemd's DynamicUser */
+inline constexpr std::uint32_t locusr_large_uid_subuid      = 100000; /* default subordinated UIDs */
+inline constexpr std::uint8_t  locusr_large_uid_appid_bits  = 6;      /* default APPID bits of window 1 */
+
+inline constexpr std::uint32_t locusr_replica_mask          = 0x7ff00000u;
+inline constexpr std::uint32_t locusr_replica_prefix        = 0x7f900000u;
+inline constexpr std::uint32_t locusr_replica_max           = 0x00000003u;
+inline constexpr std::uint32_t locusr_replica_mask_n        = 0x00000003u;
+inline constexpr std::uint8_t  locusr_replica_shift         = 18;
+inline constexpr std::uint32_t locusr_replica_uid_max       = 0x000007ffu;
+inline constexpr std::uint32_t locusr_replica_uid_mask      = 0x000007ffu;
+inline constexpr std::uint8_t  locusr_replica_uid_shift     = 7;
+inline constexpr std::uint32_t locusr_replica_appid_max     = 0x0000007fu;
+inline constexpr std::uint32_t locusr_replica_appid_mask    = 0x0000007fu;
+
+/* identity of the UID */
+constexpr identity user(std::uint32_t uid) noexcept
+{
+	return identity{ LOCALUSER_UID, uid, 0, 0 };
+}
+
+/* identity of the APPID without UID */
+constexpr identity app(std::uint32_t appid) noexcept
+{
+	return identity{ LOCALUSER_APPID, 0, appid, 0 };
+}
+
+/* identity of the UID and APPID, or of its replica from 1 to 3 */
+constexpr identity user_app(std::uint32_t uid, std::uint32_t appid, unsigned replica = 0) noexcept
+{
+	return identity{ LOCALUSER_UID | LOCALUSER_APPID, uid, appid, replica };
+}
+
+/* test if id is valid, as localuser_format_name does */
+constexpr bool is_valid(const identity &id) noexcept
+{
+	return (id.flags & (LOCALUSER_UID | LOCALUSER_APPID))
+		&& id.replica <= locusr_replica_max
+		&& (!id.replica || id.flags == (LOCALUSER_UID | LOCALUSER_APPID));
+}
+
+/* the address adr in network order */
+constexpr std::uint32_t to_network(std::uint32_t adr) noexcept
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return (adr >> 24) | ((adr >> 8) & 0xff00u) | ((adr << 8) & 0xff0000u) | (adr << 24);
+#else
+	return adr;
+#endif
+}
+
+/* kind of the IPv4 address adr */
+constexpr kind classify_ipv4(std::uint32_t adr) noexcept
+{
+	if ((adr & prefix_mask) != prefix_value)
+		return LOCALUSER_KIND_NONE;
+	if ((adr & locusr_both_ids_mask) == locusr_both_ids_prefix)
+		return LOCALUSER_KIND_BOTH;
+	if ((adr & locusr_appid_only_mask) == locusr_appid_only_prefix)
+		return LOCALUSER_KIND_APPID;
+	if ((adr & locusr_uid_only_mask) == locusr_uid_only_prefix)
+		return LOCALUSER_KIND_UID;
+	if ((adr & locusr_large_uid_mask) == locusr_large_uid_prefix)
+		return LOCALUSER_KIND_LARGE_UID;
+	if ((adr & locusr_replica_mask) == locusr_replica_prefix
+	 && ((adr >> locusr_replica_shift) & locusr_replica_mask_n))
+		return LOCALUSER_KIND_REPLICA;
+	return LOCALUSER_KIND_RESERVED;
+}
+
+/*
+ * Store in adr the IPv4 address of id.
+ * Returns LOCALUSER_OK, LOCALUSER_INVALID or LOCALUSER_OUT_OF_RANGE.
+ */
+constexpr int encode_ipv4(const identity &id, std::uint32_t &adr,
+			  std::uint32_t subuid = locusr_large_uid_subuid,
+			  std::uint8_t appid_bits = locusr_large_uid_appid_bits) noexcept
+{
+	if (!is_valid(id))
+		return LOCALUSER_INVALID;
+	if (id.replica) {
+		/* case of a replica of UID and APPID */
+		if (id.uid > locusr_replica_uid_max || id.appid > locusr_replica_appid_max)
+			return LOCALUSER_OUT_OF_RANGE;
+		adr = locusr_replica_prefix
+			| (id.replica << locusr_replica_shift)
+			| (id.uid << locusr_replica_uid_shift)
+			| id.appid;
+	} else if (id.flags == (LOCALUSER_UID | LOCALUSER_APPID)) {
+		if (id.appid <= locusr_both_ids_appid_max && id.uid <= locusr_both_ids_uid_max) {
+			/* case of UID and APPID */
+			adr = locusr_both_ids_prefix
+				| (id.appid << locusr_both_ids_appid_shift)
+				| id.uid;
+		} else if (id.appid <= locusr_large_uid_appid_max
+			&& id.uid - locusr_large_uid_dynamic <= locusr_large_uid_uid_max) {
+			/* case of large UID of the window 0 and APPID */
+			adr = locusr_large_uid_prefix
+				| ((id.uid - locusr_large_uid_dynamic) << locusr_large_uid_uid_shift)
+				| id.appid;
+		} else if (id.appid <= (1u << appid_bits) - 1
+			&& id.uid - subuid <= (locusr_large_uid_window >> appid_bits) - 1) {
+			/* case of large UID of the window 1 and APPID */
+			adr = locusr_large_uid_prefix
+				| locusr_large_uid_window
+				| ((id.uid - subuid) << appid_bits)
+				| id.appid;
+		} else
+			return LOCALUSER_OUT_OF_RANGE;
+	} else if (id.flags == LOCALUSER_APPID) {
+		/* case of only APPID */
+		if (id.appid > locusr_appid_only_appid_max)
+			return LOCALUSER_OUT_OF_RANGE;
+		adr = locusr_appid_only_prefix | id.appid;
+	} else {
+		/* case of only UID */
+		if (id.uid > locusr_uid_only_uid_max)
+			return LOCALUSER_OUT_OF_RANGE;
+		adr = locusr_uid_only_prefix | id.uid;
+	}
+	return LOCALUSER_OK;
+}
+
+/* the IPv4 address of id or 0 when it has none */
+constexpr std::uint32_t ipv4_of(const identity &id,
+				std::uint32_t subuid = locusr_large_uid_subuid,
+				std::uint8_t appid_bits = locusr_large_uid_appid_bits) noexcept
+{
+	std::uint32_t adr = 0;
+
+	return encode_ipv4(id, adr, subuid, appid_bits) == LOCALUSER_OK ? adr : 0;
+}
+
+/*
+ * Decode the IPv4 address adr in id.
+ * Returns LOCALUSER_OK, LOCALUSER_NOT_LOCALUSER or LOCALUSER_INVALID.
+ */
+constexpr int decode_ipv4(std::uint32_t adr, identity &id,
+			  std::uint32_t subuid = locusr_large_uid_subuid,
+			  std::uint8_t appid_bits = locusr_large_uid_appid_bits) noexcept
+{
+	switch (classify_ipv4(adr)) {
+	case LOCALUSER_KIND_NONE:
+		return LOCALUSER_NOT_LOCALUSER;
+	case LOCALUSER_KIND_BOTH:
+		id = user_app(adr & locusr_both_ids_uid_mask,
+			      (adr >> locusr_both_ids_appid_shift) & locusr_both_ids_appid_mask);
+		break;
+	case LOCALUSER_KIND_APPID:
+		id = app(adr & locusr_appid_only_appid_mask);
+		break;
+	case LOCALUSER_KIND_UID:
+		id = user(adr & locusr_uid_only_uid_mask);
+		break;
+	case LOCALUSER_KIND_LARGE_UID:
+		if (adr & locusr_large_uid_window)
+			id = user_app(subuid + ((adr & (locusr_large_uid_window - 1)) >> appid_bits),
+				      adr & ((1u << appid_bits) - 1));
+		else
+			id = user_app(((adr >> locusr_large_uid_uid_shift) & locusr_large_uid_uid_mask)
+					+ locusr_large_uid_dynamic,
+				      adr & locusr_large_uid_appid_mask);
+		break;
+	case LOCALUSER_KIND_REPLICA:
+		id = user_app((adr >> locusr_replica_uid_shift) & locusr_replica_uid_mask,
+			      adr & locusr_replica_appid_mask,
+			      (adr >> locusr_replica_shift) & locusr_replica_mask_n);
+		break;
+	default:
+		/* reserved address */
+		return LOCALUSER_INVALID;
+	}
+	return LOCALUSER_OK;
+}
+
+/* a name with its final zero */
+struct name_buffer
+{
+	char data[LOCALUSER_NAME_SIZE];	/* the name */
+	std::size_t size;		/* its length */
+
+	constexpr std::string_view view() const noexcept { return { data, size }; }
+};
+
+namespace detail {
+
+/* append the decimal value to name */
+constexpr void append_u32(name_buffer &name, std::uint32_t value) noexcept
+{
+	char digits[10] = {};
+	std::size_t n = 0;
+
+	do {
+		digits[n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value);
+	while (n)
+		name.data[name.size++] = digits[--n];
+}
+
+/* the char at i of str or 0 at its end */
+constexpr char at(std::string_view str, std::size_t i) noexcept
+{
+	return i < str.size() ? str[i] : 0;
+}
+
+/* test if str ends the name, maybe with a final dot */
+constexpr bool is_end(std::string_view str) noexcept
+{
+	return str.empty() || str == ".";
+}
+
+/* read the number of str in canonical form, as read_u32 of localuser.c */
+inline int read_u32(std::string_view str, std::uint32_t &value) noexcept
+{
+	auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+	int len = (int)(ptr - str.data());
+
+	if (ec == std::errc::invalid_argument)
+		return 0;
+	if (ec != std::errc() || (len > 1 && str[0] == '0'))
+		return -1; /* overflow or leading zero */
+	return len;
+}
+
+} // namespace detail
+
+/*
+ * The canonical name of id, me being the current UID, or an empty name
+ * when id is invalid.
+ */
+constexpr name_buffer name_of(const identity &id, std::uint32_t me) noexcept
+{
+	constexpr std::string_view prefix = "localuser";
+	name_buffer name = {};
+
+	if (!is_valid(id))
+		return name;
+	for (char c : prefix)
+		name.data[name.size++] = c;
+	if (!(id.flags & LOCALUSER_UID)) {
+		name.data[name.size++] = '-';
+		name.data[name.size++] = '-';
+	} else if (id.uid != me) {
+		name.data[name.size++] = '-';
+		detail::append_u32(name, id.uid);
+	} else if (id.flags & LOCALUSER_APPID)
+		name.data[name.size++] = '-';
+	if (id.flags & LOCALUSER_APPID) {
+		name.data[name.size++] = '-';
+		detail::append_u32(name, id.appid);
+	}
+	if (id.replica) {
+		name.data[name.size++] = '.';
+		name.data[name.size++] = (char)('0' + id.replica);
+	}
+	return name;
+}
+
+/*
+ * Write the canonical name of id in buffer of size bytes, as
+ * localuser_format_name does. Returns the length of the name or 0 when
+ * id is invalid.
+ */
+constexpr std::size_t format_name(const identity &id, std::uint32_t me,
+				  char *buffer, std::size_t size) noexcept
+{
+	name_buffer name = name_of(id, me);
+	std::size_t i = 0;
+
+	if (size) {
+		for (i = 0 ; i < name.size && i < size - 1 ; i++)
+			buffer[i] = name.data[i];
+		buffer[i] = 0;
+	}
+	return name.size;
+}
+
+/*
+ * Parse the name in id, me being the current UID.
+ * Returns LOCALUSER_OK, LOCALUSER_NOT_LOCALUSER, LOCALUSER_INVALID or
+ * LOCALUSER_OUT_OF_RANGE when the name has no IPv4 address.
+ */
+inline int parse_name(std::string_view name, std::uint32_t me, identity &id,
+		      std::uint32_t subuid = locusr_large_uid_subuid,
+		      std::uint8_t appid_bits = locusr_large_uid_appid_bits) noexcept
+{
+	constexpr std::string_view prefix = "localuser";
+	identity result = {};
+	std::uint32_t adr = 0;
+	std::size_t i;
+	int r;
+
+	/* test the prefix of the name */
+	if (name.size() < prefix.size())
+		return LOCALUSER_NOT_LOCALUSER;
+	for (i = 0 ; i < prefix.size() ; i++)
+		if ((name[i] | 0x20) != prefix[i])
+			return LOCALUSER_NOT_LOCALUSER;
+	name.remove_prefix(prefix.size());
+
+	if (detail::is_end(name))
+		/* "localuser" */
+		result = user(me);
+	else {
+		/* should be "localuser-...", otherwise it isn't a localuser name */
+		if (name[0] != '-')
+			return LOCALUSER_NOT_LOCALUSER;
+		name.remove_prefix(1);
+		if (detail::at(name, 0) == '-') {
+			name.remove_prefix(1);
+			if (detail::at(name, 0) == '-') {
+				/* "localuser---..." */
+				name.remove_prefix(1);
+				result.flags = LOCALUSER_APPID;
+			} else
+				/* "localuser--..." */
+				result = user_app(me, 0);
+		} else {
+			/* "localuser-UID..." */
+			r = detail::read_u32(name, result.uid);
+			if (r <= 0)
+				return LOCALUSER_INVALID;
+			name.remove_prefix((std::size_t)r);
+			result.flags = LOCALUSER_UID;
+			if (detail::at(name, 0) == '-') {
+				name.remove_prefix(1);
+				result.flags |= LOCALUSER_APPID;
+			}
+		}
+		if (result.flags & LOCALUSER_APPID) {
+			/* "localuser-[UID|-]-APPID..." */
+			r = detail::read_u32(name, result.appid);
+			if (r <= 0)
+				return LOCALUSER_INVALID;
+			name.remove_prefix((std::size_t)r);
+			/* look for a replica number ".N" */
+			if (detail::at(name, 0) == '.' && '1' <= detail::at(name, 1)
+			 && detail::at(name, 1) <= (char)('0' + locusr_replica_max)
+			 && detail::is_end(name.substr(2))) {
+				result.replica = (unsigned)(name[1] - '0');
+				name.remove_prefix(2);
+			}
+		}
+		/* the name should be finished now: any other suffix is invalid */
+		if (!detail::is_end(name))
+			return LOCALUSER_INVALID;
+	}
+
+	if (encode_ipv4(result, adr, subuid, appid_bits) != LOCALUSER_OK)
+		return LOCALUSER_OUT_OF_RANGE;
+	id = result;
+	return LOCALUSER_OK;
+}
+
+} // namespace localuser
@@ -0,0 +1,1376 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * test-codec.c
+ * ------------
+ *  Checks of the internal functions of localuser.c and of the codec of
+ *  liblocaluser.c, included below.
+ *
+ *  usage: test-codec [-q]
+ *
+ *  The option -q skips the exhaustive checks over the 32 bits values.
+ */
+#include "localuser.c"
+#include "liblocaluser.c"
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+static unsigned long failures;
+static int quick;
+
+/* report a failure */
+static void fail(const char *what, const char *arg)
+{
+	if (failures++ < 20)
+		printf("FAILED %s: %s\n", what, arg);
+}
+
+/* the parser of the version 1.0, that is the reference */
+static int ref_read_u32(const char *str, uint32_t *val)
+{
+	char c;
+	int p;
+	uint32_t a, b;
+
+	a = 0;
+	c = str[p = 0];
+	while ('0' <= c && c <= '9') {
+		b = (a << 3) + (a << 1) + (uint32_t)(c - '0');
+		if (b < a)
+			return -1; /* overflow */
+		a = b;
+		c = str[++p];
+	}
+	*val = a;
+	return p;
+}
+
+/*
+ * Check read_u32 against the reference and write_u32 against the
+ * expected digits for every 32 bits value
+ */
+static void check_u32_exhaustive(void)
+{
+	char buf[32], out[16], *str;
+	uint32_t v, r, x;
+	int len, i, n;
+
+	/* buf holds the digits of v right aligned before position 10 */
+	memset(buf, 'x', sizeof buf);
+	buf[9] = '0';
+	buf[10] = 0;
+	len = 1;
+	v = 0;
+	for (;;) {
+		str = &buf[10 - len];
+		n = read_u32(str, &x);
+		if (n != len || x != v || ref_read_u32(str, &r) != len || r != v)
+			fail("read_u32 exhaustive", str);
+		if (write_u32(out, v) != (unsigned)len || memcmp(out, str, (size_t)len))
+			fail("write_u32 exhaustive", str);
+		if (v == UINT32_MAX)
+			break;
+		v++;
+		for (i = 9 ; buf[i] == '9' ; i--)
+			buf[i] = '0';
+		if (i < 10 - len) {
+			buf[i] = '1';
+			len++;
+		} else
+			buf[i]++;
+	}
+}
+
+/* check the non canonical forms and overflows */
+static void check_read_u32_reject(void)
+{
+	static const char *const bad[] = {
+		"00", "01", "0001", "000000000000000000000000000001",
+		"4294967296", "9999999999", "10000000000", "42949672950"
+	};
+	static const char *const good[] = {
+		"0", "7", "12345678", "123456789", "4294967295", "0-", "12-34"
+	};
+	char buf[32];
+	uint32_t x;
+	unsigned i;
+	uint64_t v;
+
+	for (i = 0 ; i < sizeof bad / sizeof *bad ; i++)
+		if (read_u32(bad[i], &x) != -1)
+			fail("read_u32 accepts", bad[i]);
+	for (i = 0 ; i < sizeof good / sizeof *good ; i++)
+		if (read_u32(good[i], &x) != (int)strspn(good[i], "0123456789")
+		 || x != strtoul(good[i], NULL, 10))
+			fail("read_u32 rejects", good[i]);
+	for (v = 4294967296u ; v < 10000000000u ; v += 7777777) {
+		sprintf(buf, "%llu", (unsigned long long)v);
+		if (read_u32(buf, &x) != -1)
+			fail("read_u32 overflow", buf);
+	}
+}
+
+/* check that reading near the end of a page works and doesn't fault */
+static void check_read_u32_page(void)
+{
+	char *page, *str;
+	uint32_t x;
+	size_t len;
+	static const char *const values[] = { "5", "123", "1234567", "12345678", "4294967295" };
+	unsigned i;
+
+	page = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED || mprotect(&page[4096], 4096, PROT_NONE)) {
+		fail("mmap", "page");
+		return;
+	}
+	for (i = 0 ; i < sizeof values / sizeof *values ; i++) {
+		len = strlen(values[i]);
+		str = &page[4096 - len - 1];
+		memcpy(str, values[i], len + 1);
+		if (read_u32(str, &x) != (int)len || x != strtoul(values[i], NULL, 10))
+			fail("read_u32 at end of page", values[i]);
+	}
+	munmap(page, 8192);
+}
+
+/* check that each address of 127.128.0.0/9 decodes to a name giving it back */
+static void check_ipv4_roundtrip(void)
+{
+	struct lud lud, lud2;
+	uint32_t adr;
+	char name[64], ip[32];
+	int rc;
+
+	for (adr = prefix_value ; (adr & prefix_mask) == prefix_value ; adr++) {
+		rc = decode_ipv4(htonl(adr), &lud);
+		if (rc != 1) {
+			if ((adr & locusr_both_ids_mask) == locusr_both_ids_prefix
+			 || (adr & locusr_appid_only_mask) == locusr_appid_only_prefix
+			 || (adr & locusr_uid_only_mask) == locusr_uid_only_prefix
+			 || (adr & locusr_large_uid_mask) == locusr_large_uid_prefix
+			 || ((adr & locusr_replica_mask) == locusr_replica_prefix
+			    && ((adr >> locusr_replica_shift) & locusr_replica_mask_n))) {
+				sprintf(ip, "%08x", adr);
+				fail("decode_ipv4", ip);
+			}
+			continue;
+		}
+		encode_name(&lud, name);
+		if (strlen(name) != lud.len)
+			fail("measure_name", name);
+		if (decode_name(name, &lud2) != 1 || lud2.ipv4 != lud.ipv4 || lud2.len != lud.len)
+			fail("decode_name", name);
+	}
+}
+
+/* check the status of the entries for the given name */
+static void check_name_status(const char *name, enum nss_status expected)
+{
+	struct hostent he;
+	struct gaih_addrtuple *pat = NULL;
+	char buffer[1024], *canon;
+	int err, herr;
+
+	herr = 0;
+	if (_nss_localuser_gethostbyname3_r(name, AF_INET, &he, buffer, sizeof buffer,
+			&err, &herr, NULL, NULL) != expected || herr != HOST_NOT_FOUND)
+		fail("gethostbyname3_r status", name);
+	herr = 0;
+	if (_nss_localuser_gethostbyname4_r(name, &pat, buffer, sizeof buffer,
+			&err, &herr, NULL) != expected || herr != HOST_NOT_FOUND)
+		fail("gethostbyname4_r status", name);
+	herr = 0;
+	if (_nss_localuser_getcanonname_r(name, buffer, sizeof buffer, &canon,
+			&err, &herr) != expected || herr != HOST_NOT_FOUND)
+		fail("getcanonname_r status", name);
+}
+
+/* check the status of gethostbyaddr_r for the given address */
+static void check_addr_status(uint32_t adr, enum nss_status expected)
+{
+	struct hostent he;
+	char buffer[1024], ip[32];
+	int err, herr;
+
+	adr = htonl(adr);
+	if (_nss_localuser_gethostbyaddr_r(&adr, lenip4, AF_INET, &he, buffer, sizeof buffer,
+			&err, &herr) != expected) {
+		sprintf(ip, "%08x", ntohl(adr));
+		fail("gethostbyaddr_r status", ip);
+	}
+}
+
+/*
+ * check that in authoritative mode, the invalid names and addresses of
+ * localuser return NSS_STATUS_UNAVAIL that stops the lookup when the
+ * hosts line has "localuser [UNAVAIL=return]" and that other names and
+ * addresses return NSS_STATUS_NOTFOUND that continues to next services
+ */
+static void check_authoritative(void)
+{
+	static const char *const invalids[] = {
+		"localuser-5000-3", "localuser-x", "localuser-0001", "localuser-",
+		"localuser--", "localuser-1-2-3", "localuser---1048576",
+		"localuser-5-7.4", "localuser--5.0", "localuser-1001.9x",
+		"localuser-5-7.1x", "localuser-1001.example.com"
+	};
+	static const char *const others[] = {
+		"example.com", "localhost", "localusers", "local"
+	};
+	unsigned i;
+	int auth;
+
+	get_config();
+	for (auth = 0 ; auth <= 1 ; auth++) {
+		config.authoritative = auth & 1;
+		for (i = 0 ; i < sizeof invalids / sizeof *invalids ; i++)
+			check_name_status(invalids[i], auth ? NSS_STATUS_UNAVAIL : NSS_STATUS_NOTFOUND);
+		for (i = 0 ; i < sizeof others / sizeof *others ; i++)
+			check_name_status(others[i], NSS_STATUS_NOTFOUND);
+		check_addr_status(0x7f900001u, auth ? NSS_STATUS_UNAVAIL : NSS_STATUS_NOTFOUND);
+		check_addr_status(0x7f000001u, NSS_STATUS_NOTFOUND);
+		check_addr_status(locusr_uid_only_prefix | 1, NSS_STATUS_SUCCESS);
+	}
+	config.authoritative = 0;
+}
+
+/* check that the spellings of a name resolve to the same address and name */
+static void check_variants(void)
+{
+	static const char *const same[] = {
+		"localuser-1001-78", "localuser-1001-78.", "LocalUser-1001-78",
+		"LOCALUSER-1001-78.CORP.EXAMPLE.", "localuser-1001-78.corp.example",
+		"localuser-1001-78.lan", "lOcAlUsEr-1001-78.Lan."
+	};
+	static const char *const others[] = {
+		"localuser-1001-78.other.example", "localuser-1001-78..",
+		"localuser-1001-78.corp.example..", "localuser-1001-78.corp",
+		"localuser-1001-78.corp.examples", "localuser-1001-78.xlan"
+	};
+	struct lud ref, lud;
+	char name[64], refname[64];
+	unsigned i;
+
+	get_config();
+	config.ndomains = 2;
+	strcpy(config.domains[0], "corp.example");
+	strcpy(config.domains[1], "lan");
+
+	decode_name(same[0], &ref);
+	encode_name(&ref, refname);
+	for (i = 0 ; i < sizeof same / sizeof *same ; i++) {
+		if (decode_name(same[i], &lud) != 1 || lud.ipv4 != ref.ipv4) {
+			fail("decode_name variant", same[i]);
+			continue;
+		}
+		encode_name(&lud, name);
+		if (strcmp(name, refname))
+			fail("encode_name variant", same[i]);
+	}
+	for (i = 0 ; i < sizeof others / sizeof *others ; i++)
+		if (decode_name(others[i], &lud) != -1)
+			fail("decode_name foreign domain", others[i]);
+	if (decode_name("localuser.example.com", &lud) != 0)
+		fail("decode_name foreign", "localuser.example.com");
+	if (decode_name("LOCALUSER.lan.", &lud) != 1 || lud.uid != lud.me || lud.has_appid)
+		fail("decode_name variant", "LOCALUSER.lan.");
+
+	config.ndomains = 0;
+}
+
+/* check the names of large UIDs of the windows and the addresses they give */
+static void check_large_uid(void)
+{
+	static const uint32_t bases[] = { 61184, 100000 };
+	static const char *const outs[] = {
+		"localuser-61183-1", "localuser-69376-1", "localuser-99999-1",
+		"localuser-108192-1", "localuser-61184-64", "localuser-100000-2048"
+	};
+	struct lud lud, lud2;
+	char name[64];
+	uint32_t uid, appid, adr;
+	unsigned w, i;
+
+	get_config();
+	for (w = 0 ; w < 2 ; w++) {
+		for (uid = bases[w] ; uid <= bases[w] + locusr_large_uid_uid_max ; uid++) {
+			for (appid = 0 ; appid <= locusr_large_uid_appid_max ; appid++) {
+				sprintf(name, "localuser-%u-%u", uid, appid);
+				if (decode_name(name, &lud) != 1) {
+					fail("decode_name large uid", name);
+					continue;
+				}
+				adr = ntohl(lud.ipv4);
+				if ((adr & locusr_large_uid_mask) != locusr_large_uid_prefix
+				 || !(adr & locusr_large_uid_window) != !w)
+					fail("decode_name large uid layout", name);
+				if (decode_ipv4(lud.ipv4, &lud2) != 1
+				 || !lud2.has_uid || !lud2.has_appid
+				 || lud2.uid != uid || lud2.appid != appid)
+					fail("decode_ipv4 large uid", name);
+			}
+		}
+	}
+	for (i = 0 ; i < sizeof outs / sizeof *outs ; i++)
+		if (decode_name(outs[i], &lud) != -2)
+			fail("decode_name large uid out of range", outs[i]);
+}
+
+/* check the window 1 of large UIDs with other bits of APPID */
+static void check_subuid_bits(void)
+{
+	static const uint8_t bits[] = { 0, 3, 13 };
+	struct lud lud, lud2;
+	char name[64];
+	uint32_t adr;
+	unsigned b;
+
+	get_config();
+	for (b = 0 ; b < sizeof bits / sizeof *bits ; b++) {
+		config.subuid_appid_bits = bits[b];
+		for (adr = 0 ; adr < locusr_large_uid_window ; adr += quick ? 7 : 1) {
+			lud.ipv4 = htonl(locusr_large_uid_prefix | locusr_large_uid_window | adr);
+			sprintf(name, "%u/%u", (unsigned)adr, (unsigned)bits[b]);
+			if (decode_ipv4(lud.ipv4, &lud) != 1 || !lud.has_uid || !lud.has_appid
+			 || lud.uid != config.subuid + (adr >> bits[b])
+			 || lud.appid != (adr & ((1u << bits[b]) - 1))) {
+				fail("decode_ipv4 subuid bits", name);
+				continue;
+			}
+			sprintf(name, "localuser-%u-%u", (unsigned)lud.uid, (unsigned)lud.appid);
+			if (decode_name(name, &lud2) != 1 || lud2.ipv4 != lud.ipv4)
+				fail("decode_name subuid bits", name);
+		}
+		sprintf(name, "localuser-%u-%u", (unsigned)(config.subuid + subuid_uid_max() + 1), 0u);
+		if (decode_name(name, &lud) != -2)
+			fail("decode_name subuid bits out of range", name);
+		sprintf(name, "localuser-%u-%u", (unsigned)config.subuid, (unsigned)(subuid_appid_max() + 1));
+		if (decode_name(name, &lud) == 1
+		 && (ntohl(lud.ipv4) & locusr_large_uid_mask) == locusr_large_uid_prefix
+		 && ntohl(lud.ipv4) & locusr_large_uid_window)
+			fail("decode_name subuid bits appid", name);
+	}
+	/* 3 bits cover 65536 UIDs */
+	config.subuid_appid_bits = 3;
+	if (decode_name("localuser-165535-7", &lud) != 1)
+		fail("decode_name subuid bits", "localuser-165535-7");
+	config.subuid_appid_bits = locusr_large_uid_appid_bits;
+	if (decode_name("localuser-165535-7", &lud) != -2)
+		fail("decode_name subuid bits", "localuser-165535-7");
+}
+
+/* check the names of replicas and the addresses they give */
+static void check_replicas(void)
+{
+	static const char *const outs[] = {
+		"localuser---5.1", "localuser-2048-5.1", "localuser-5-128.3"
+	};
+	struct lud lud, lud2;
+	char name[64], name2[64];
+	uint32_t uid, appid, primary;
+	unsigned n, i;
+
+	for (uid = 0 ; uid <= locusr_replica_uid_max ; uid++) {
+		for (appid = 0 ; appid <= locusr_replica_appid_max ; appid++) {
+			sprintf(name, "localuser-%u-%u", uid, appid);
+			decode_name(name, &lud);
+			primary = lud.ipv4;
+			for (n = 1 ; n <= locusr_replica_max ; n++) {
+				sprintf(name, "localuser-%u-%u.%u", uid, appid, n);
+				if (decode_name(name, &lud) != 1 || lud.replica != n
+				 || lud.ipv4 == primary) {
+					fail("decode_name replica", name);
+					continue;
+				}
+				if (decode_ipv4(lud.ipv4, &lud2) != 1 || lud2.replica != n
+				 || lud2.uid != uid || lud2.appid != appid)
+					fail("decode_ipv4 replica", name);
+				encode_name(&lud2, name2);
+				if (decode_name(name2, &lud) != 1 || lud.ipv4 != lud2.ipv4)
+					fail("encode_name replica", name2);
+			}
+		}
+	}
+	for (i = 0 ; i < sizeof outs / sizeof *outs ; i++)
+		if (decode_name(outs[i], &lud) != -2)
+			fail("decode_name replica out of range", outs[i]);
+	if (decode_name("localuser-5-7.4", &lud) != -1)
+		fail("decode_name replica invalid", "localuser-5-7.4");
+}
+
+/* check the native IPv6 addresses */
+static void check_native_ipv6(void)
+{
+	static const struct { const char *name; uint32_t uid, appid; int has_ipv4; } names[] = {
+		{ "localuser-1001-78", 1001, 78, 1 },
+		{ "localuser-4000000000-4294967294", 4000000000u, 4294967294u, 0 },
+		{ "localuser---4294967294", 0xffffffffu, 4294967294u, 0 },
+		{ "localuser-4294967294", 4294967294u, 0xffffffffu, 0 },
+		{ "localuser-70000", 70000, 0xffffffffu, 1 }
+	};
+	static const char *const outs[] = {
+		"localuser-4294967295", "localuser-5-4294967295", "localuser-5000-3.1"
+	};
+	struct hostent he;
+	struct lud lud;
+	char buffer[1024], name[64];
+	uint32_t *ip, addr[4];
+	unsigned i;
+	int err, herr;
+
+	get_config();
+	config.ipv6_native = 1;
+	for (i = 0 ; i < sizeof names / sizeof *names ; i++) {
+		if (_nss_localuser_gethostbyname2_r(names[i].name, AF_INET6, &he, buffer,
+				sizeof buffer, &err, &herr) != NSS_STATUS_SUCCESS) {
+			fail("native ipv6 forward", names[i].name);
+			continue;
+		}
+		ip = (uint32_t*)he.h_addr_list[0];
+		if (memcmp(ip, config.ipv6_prefix, 8) || ntohl(ip[2]) != names[i].uid
+		 || ntohl(ip[3]) != names[i].appid)
+			fail("native ipv6 layout", names[i].name);
+		strcpy(name, he.h_name);
+		memcpy(addr, ip, sizeof addr);
+		if (_nss_localuser_gethostbyaddr_r(addr, lenip6, AF_INET6, &he, buffer,
+				sizeof buffer, &err, &herr) != NSS_STATUS_SUCCESS
+		 || strcmp(he.h_name, name) || memcmp(he.h_addr_list[0], addr, sizeof addr))
+			fail("native ipv6 reverse", names[i].name);
+		if ((_nss_localuser_gethostbyname2_r(names[i].name, AF_INET, &he, buffer,
+				sizeof buffer, &err, &herr) == NSS_STATUS_SUCCESS) != names[i].has_ipv4)
+			fail("native ipv6 has ipv4", names[i].name);
+	}
+	for (i = 0 ; i < sizeof outs / sizeof *outs ; i++)
+		if (decode_name(outs[i], &lud) != -2)
+			fail("native ipv6 out of range", outs[i]);
+
+	/* replicas stay IPv4-mapped */
+	if (_nss_localuser_gethostbyname2_r("localuser-5-7.2", AF_INET6, &he, buffer,
+			sizeof buffer, &err, &herr) != NSS_STATUS_SUCCESS
+	 || ((uint32_t*)he.h_addr_list[0])[2] != htonl(0xffff))
+		fail("native ipv6 replica", "localuser-5-7.2");
+
+	/* no UID and no APPID is invalid */
+	memcpy(addr, config.ipv6_prefix, 8);
+	addr[2] = addr[3] = locusr_ipv6_none;
+	if (decode_ipv6(addr, &lud) != -1)
+		fail("native ipv6 reserved", "no ids");
+
+	config.ipv6_native = 0;
+	if (decode_ipv6(addr, &lud) != 0)
+		fail("native ipv6 disabled", "decode_ipv6");
+}
+
+/*
+ * Check that the canonical name of the spellings of a name, given by
+ * getcanonname_r and as name of each tuple of gethostbyname4_r, is the
+ * shortest one: glibc then fills ai_canonname of getaddrinfo from the
+ * tuples without calling the module again. The %u of the spellings is
+ * the current UID.
+ */
+static void check_canonname(void)
+{
+	static const struct { const char *name, *canon; } names[] = {
+		{ "localuser-%u-78", "localuser--78" },
+		{ "LocalUser-%u-78.", "localuser--78" },
+		{ "localuser--78", "localuser--78" },
+		{ "localuser-%u", "localuser" },
+		{ "localuser-%u-78.2", "localuser--78.2" },
+		{ "localuser---78", "localuser---78" }
+	};
+	static const enum unspec_mode modes[] = { unspec_inet, unspec_inet6, unspec_both };
+	struct gaih_addrtuple *pat, *t;
+	char name[64], buffer[1024], *canon;
+	enum unspec_mode saved;
+	unsigned i, m, count;
+	int err, herr;
+
+	get_config();
+	saved = config.unspec;
+	for (i = 0 ; i < sizeof names / sizeof *names ; i++) {
+		snprintf(name, sizeof name, names[i].name, current_uid());
+		canon = NULL;
+		if (_nss_localuser_getcanonname_r(name, buffer, sizeof buffer, &canon, &err, &herr)
+				!= NSS_STATUS_SUCCESS || !canon || strcmp(canon, names[i].canon))
+			fail("getcanonname_r", name);
+		for (m = 0 ; m < sizeof modes / sizeof *modes ; m++) {
+			config.unspec = modes[m];
+			pat = NULL;
+			if (_nss_localuser_gethostbyname4_r(name, &pat, buffer, sizeof buffer,
+					&err, &herr, NULL) != NSS_STATUS_SUCCESS || !pat) {
+				fail("gethostbyname4_r canonical", name);
+				continue;
+			}
+			for (t = pat, count = 0 ; t ; t = t->next, count++)
+				if (!t->name || strcmp(t->name, names[i].canon))
+					fail("gethostbyname4_r tuple name", name);
+			if (count != (modes[m] == unspec_both ? 2u : 1u))
+				fail("gethostbyname4_r tuples", name);
+		}
+	}
+	config.unspec = saved;
+}
+
+/*
+ * check the name and the aliases of the entry of name resolved as if
+ * the current user was me. The expected names are separated by spaces,
+ * the canonical name first.
+ */
+static void check_aliases(const char *name, uint32_t me, const char *expected)
+{
+	struct hostent he;
+	struct lud lud;
+	char buffer[1024], names[512];
+	size_t len;
+	unsigned i;
+	int err, herr;
+
+	if (decode_name(name, &lud) != 1) {
+		fail("aliases decode", name);
+		return;
+	}
+	lud.me = me;
+	measure_name(&lud);
+	if (fillent(&lud, AF_INET, &he, buffer, sizeof buffer, &err, &herr) != NSS_STATUS_SUCCESS) {
+		fail("aliases fill", name);
+		return;
+	}
+	len = (size_t)snprintf(names, sizeof names, "%s", he.h_name);
+	for (i = 0 ; he.h_aliases[i] ; i++)
+		len += (size_t)snprintf(&names[len], sizeof names - len, " %s", he.h_aliases[i]);
+	if (strcmp(names, expected)) {
+		printf("  got %s\n", names);
+		fail("aliases", expected);
+	}
+
+	/* the exact size is enough and any smaller size is too small */
+	len = i ? (size_t)(he.h_aliases[i - 1] - buffer) + strlen(he.h_aliases[i - 1]) + 1
+		: (size_t)(he.h_name - buffer) + strlen(he.h_name) + 1;
+	for (i = 0 ; i < len ; i++)
+		if (fillent(&lud, AF_INET, &he, buffer, i, &err, &herr) != NSS_STATUS_TRYAGAIN
+		 || err != ERANGE)
+			fail("aliases ERANGE", name);
+	if (fillent(&lud, AF_INET, &he, buffer, len, &err, &herr) != NSS_STATUS_SUCCESS)
+		fail("aliases exact size", name);
+}
+
+/*
+ * write the index of path.db from the text, a registry of applications
+ * or, if opts is "-p", a passwd file. Returns 0 on success.
+ */
+static int make_index(const char *path, const char *opts, const char *text)
+{
+	char cmd[256];
+	FILE *file;
+
+	file = fopen(path, "w");
+	if (!file)
+		return -1;
+	fputs(text, file);
+	fclose(file);
+	snprintf(cmd, sizeof cmd, "./localuser-mkdb %s -o %s.db %s 2>/dev/null", opts, path, path);
+	return system(cmd);
+}
+
+/* write the registry of path.db from the text apps, returns 0 on success */
+static int make_registry(const char *path, const char *apps)
+{
+	return make_index(path, "", apps);
+}
+
+/* count of the lookups in progress in the index */
+static uint32_t index_users(const struct index *idx)
+{
+	return idx->users[0] + idx->users[1];
+}
+
+/* the APPID of myapp last seen by the threads of check_registry_reloads */
+static uint32_t reload_seen;
+static int reload_stop;
+
+/* look up myapp in loop */
+static void *reload_lookups(void *arg)
+{
+	struct lud lud;
+
+	(void)arg;
+	while (!__atomic_load_n(&reload_stop, __ATOMIC_RELAXED))
+		if (decode_name("localuser--myapp", &lud) == 1)
+			__atomic_store_n(&reload_seen, lud.appid, __ATOMIC_RELAXED);
+		else
+			fail("registry reloads", "lookup");
+	return NULL;
+}
+
+/* check that the changes of the registry are seen under steady lookups */
+static void check_registry_reloads(const char *path)
+{
+	pthread_t threads[4];
+	struct timespec start, now;
+	char apps[32];
+	unsigned i, n, k;
+
+	reload_stop = 0;
+	for (n = 0 ; n < sizeof threads / sizeof *threads ; n++)
+		if (pthread_create(&threads[n], NULL, reload_lookups, NULL))
+			break;
+	for (k = 100 ; k < 108 ; k++) {
+		snprintf(apps, sizeof apps, "myapp %u\n", k);
+		if (make_registry(path, apps))
+			fail("registry reloads", "make");
+		__atomic_store_n(&apps_index.next_check, 0, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			sched_yield();
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while (__atomic_load_n(&reload_seen, __ATOMIC_RELAXED) != k
+			&& now.tv_sec - start.tv_sec < 5);
+		if (reload_seen != k)
+			fail("registry reloads", apps);
+	}
+	__atomic_store_n(&reload_stop, 1, __ATOMIC_RELAXED);
+	for (i = 0 ; i < n ; i++)
+		pthread_join(threads[i], NULL);
+
+	/* the retired registries are released once the lookups end */
+	for (i = 0 ; i < 2 ; i++) {
+		apps_index.next_check = 0;
+		index_check(&apps_index);
+	}
+	if (apps_index.retired || index_users(&apps_index))
+		fail("registry reloads", "release");
+}
+
+/* check the application of the caller */
+static void check_self_app(void)
+{
+	static const struct { const char *ident, *prefix, *name; } idents[] = {
+		{ "User::App::homescreen", "User::App::", "homescreen" },
+		{ "User::App::Media-Player", "User::App::", "media-player" },
+		{ "app-media-player@1001.service", "app-", "media-player" },
+		{ "app-navigation--1.2--main.scope", "app-", "navigation" },
+		{ "app-1000.service", "app-", "1000" },
+		{ "System", "User::App::", "" },
+		{ "User::App::foo_bar", "User::App::", "" },
+		{ "User::App::", "User::App::", "" },
+		{ "app--x.service", "app-", "" }
+	};
+	static const struct { const char *name; int rc; uint32_t appid; } names[] = {
+		{ "localuser-app", 1, 42 },
+		{ "localuser-APP.2", 1, 42 },
+		{ "localuser--app", 1, 42 },
+		{ "localuser-5-app", 1, 42 },
+		{ "localuser---app", 1, 42 },
+		{ "localuser-apps", -1, 0 },
+		{ "localuser-app-5", -1, 0 },
+		{ "localuser-5-application", -1, 0 }
+	};
+	char name[MAXNAMELEN + 1];
+	struct lud lud;
+	unsigned i;
+
+	for (i = 0 ; i < sizeof idents / sizeof *idents ; i++)
+		if (app_of_identity(idents[i].ident, strlen(idents[i].ident), idents[i].prefix, name)
+				!= strlen(idents[i].name)
+		 || (idents[i].name[0] && strcmp(name, idents[i].name)))
+			fail("app of identity", idents[i].ident);
+
+	/* without identity, the keyword is invalid */
+	pthread_once(&self_app.once, read_self_app);
+	self_app.len = 0;
+	if (decode_name("localuser-app", &lud) != -1)
+		fail("self app", "no identity");
+
+	/* the application of the caller is searched in the registry */
+	self_app.len = app_of_identity("User::App::myapp", 16, "User::App::", self_app.name);
+	for (i = 0 ; i < sizeof names / sizeof *names ; i++)
+		if (decode_name(names[i].name, &lud) != names[i].rc
+		 || (names[i].rc == 1 && lud.appid != names[i].appid))
+			fail("self app decode", names[i].name);
+	if (decode_name("localuser-app", &lud) != 1 || !lud.has_uid || lud.uid != lud.me)
+		fail("self app current user", "localuser-app");
+
+	/* or given in decimal */
+	self_app.len = app_of_identity("app-1234", 8, "app-", self_app.name);
+	if (decode_name("localuser-app", &lud) != 1 || lud.appid != 1234)
+		fail("self app decimal", "app-1234");
+	self_app.len = 0;
+}
+
+/* check the registry of application names and its reload */
+static void check_registry(void)
+{
+	static const struct { const char *name; int rc; uint32_t appid; } names[] = {
+		{ "localuser--myapp", 1, 42 },
+		{ "localuser-5-MyApp", 1, 42 },
+		{ "localuser---media-player", 1, 7 },
+		{ "localuser--media-player.2", 1, 7 },
+		{ "localuser--nope", -1, 0 },
+		{ "localuser--myapp-", -1, 0 },
+		{ "localuser--my_app", -1, 0 },
+		{ "localuser--7up", -1, 0 }
+	};
+	char dir[] = "/tmp/test-codec.XXXXXX", path[64], buffer[1024];
+	const struct idxmap *map, *map2;
+	struct hostent he;
+	struct lud lud;
+	size_t len;
+	unsigned i, slot, slot2;
+	int err, herr;
+
+	if (!mkdtemp(dir)) {
+		fail("registry", "mkdtemp");
+		return;
+	}
+	snprintf(path, sizeof path, "%s/apps", dir);
+
+	/* the bytes that aren't letters, digits or dashes aren't lowered into some */
+	if (!make_registry(path, "ab\x11 7\n") || !make_registry(path, "x\x19y 7\n")
+	 || !make_registry(path, "my\x10" "app 7\n"))
+		fail("registry", "bad name");
+
+	if (make_registry(path, "# test\nmyapp 42\nMedia-Player 7\n\nnav 1000\n")) {
+		fail("registry", "localuser-mkdb");
+		return;
+	}
+	get_config();
+	snprintf(config.apps, sizeof config.apps, "%s.db", path);
+	apps_index.next_check = 0;
+
+	for (i = 0 ; i < sizeof names / sizeof *names ; i++)
+		if (decode_name(names[i].name, &lud) != names[i].rc
+		 || (names[i].rc == 1 && lud.appid != names[i].appid))
+			fail("registry decode", names[i].name);
+
+	/* the name of the application is an alias */
+	if (decode_ipv4(htonl(locusr_appid_only_prefix | 42), &lud) != 1
+	 || fillent(&lud, AF_INET, &he, buffer, sizeof buffer, &err, &herr) != NSS_STATUS_SUCCESS
+	 || strcmp(he.h_name, "localuser---42") || !he.h_aliases[0]
+	 || strcmp(he.h_aliases[0], "localuser---myapp") || he.h_aliases[1])
+		fail("registry alias", "localuser---42");
+	len = (size_t)(he.h_aliases[0] - buffer) + strlen(he.h_aliases[0]) + 1;
+	for (i = 0 ; i < len ; i++)
+		if (fillent(&lud, AF_INET, &he, buffer, i, &err, &herr) != NSS_STATUS_TRYAGAIN
+		 || err != ERANGE)
+			fail("registry alias", "ERANGE");
+	if (fillent(&lud, AF_INET, &he, buffer, len, &err, &herr) != NSS_STATUS_SUCCESS)
+		fail("registry alias", "exact size");
+	if (decode_ipv4(htonl(locusr_appid_only_prefix | 43), &lud) != 1
+	 || fillent(&lud, AF_INET, &he, buffer, sizeof buffer, &err, &herr) != NSS_STATUS_SUCCESS
+	 || he.h_aliases[0])
+		fail("registry alias", "localuser---43");
+
+	check_self_app();
+
+	/* a replaced registry is kept until its lookups end */
+	map = index_enter(&apps_index, &slot);
+	if (!map || make_registry(path, "myapp 43\n"))
+		fail("registry reload", "make");
+	apps_index.next_check = 0;
+	if (decode_name("localuser--myapp", &lud) != 1 || lud.appid != 43
+	 || decode_name("localuser--nav", &lud) != -1)
+		fail("registry reload", "new registry");
+	if (!map || apps_index.retired != map || !index_find_name(map, "nav", 3))
+		fail("registry reload", "retired registry");
+
+	/* the lookups in progress don't stop the next changes */
+	map2 = index_enter(&apps_index, &slot2);
+	if (!map2 || make_registry(path, "myapp 44\n"))
+		fail("registry reload", "make");
+	apps_index.next_check = 0;
+	if (decode_name("localuser--myapp", &lud) != 1 || lud.appid != 44)
+		fail("registry reload", "second change");
+	if (!map || !map2 || !index_find_name(map, "nav", 3) || !index_find_name(map2, "myapp", 5))
+		fail("registry reload", "retired registries");
+	index_leave(&apps_index, slot);
+	apps_index.next_check = 0;
+	index_check(&apps_index);
+	if (!apps_index.retired || apps_index.retired != map2 || apps_index.retired->next)
+		fail("registry reload", "release of the first");
+	index_leave(&apps_index, slot2);
+	apps_index.next_check = 0;
+	index_check(&apps_index);
+	if (apps_index.retired || index_users(&apps_index))
+		fail("registry reload", "release");
+
+	check_registry_reloads(path);
+
+	/* a bad file isn't used */
+	make_registry(path, "myapp 44\n");
+	snprintf(buffer, sizeof buffer, "truncate -s -1 %s.db", path);
+	if (system(buffer))
+		fail("registry", buffer);
+	apps_index.next_check = 0;
+	if (decode_name("localuser--myapp", &lud) != -1)
+		fail("registry reload", "bad file");
+
+	snprintf(buffer, sizeof buffer, "rm -r %s", dir);
+	if (system(buffer))
+		fail("registry", buffer);
+	strcpy(config.apps, APPS_FILE);
+	apps_index.next_check = 0;
+	index_check(&apps_index);
+}
+
+/* check the index of users made from a passwd file */
+static void check_users(void)
+{
+	static const char passwd[] =
+		"root:x:0:0:root:/root:/bin/sh\n"
+		"toor:x:0:0::/:/bin/sh\n"
+		"alice:x:1001:1001::/home/alice:/bin/sh\n"
+		"bob:x:1002:1002::/home/bob:/bin/sh\n"
+		"bob:x:1003:1003::/:/bin/sh\n"
+		"Carol:x:1004:1004::/:/bin/sh\n"
+		"systemd-network:x:998:998::/:/bin/false\n"
+		"big:x:4000000:1::/:/bin/sh\n";
+	static const struct { const char *name; int rc; uint32_t uid, appid; } names[] = {
+		{ "localuser-alice", 1, 1001, 0 },
+		{ "localuser-ALICE-5", 1, 1001, 5 },
+		{ "localuser-bob-7.2", 1, 1002, 7 },
+		{ "localuser-bob-myapp", 1, 1002, 42 },
+		{ "localuser-root", 1, 0, 0 },
+		{ "localuser-toor", -1, 0, 0 },
+		{ "localuser-carol", -1, 0, 0 },
+		{ "localuser-systemd-network", -1, 0, 0 },
+		{ "localuser-big", -1, 0, 0 },
+		{ "localuser-alice.2", -1, 0, 0 }
+	};
+	static const char *const aliases[] = {
+		"localuser-1002-42", "localuser-bob-42", "localuser-1002-myapp", "localuser-bob-myapp"
+	};
+	char dir[] = "/tmp/test-codec.XXXXXX", path[64], buffer[1024];
+	struct hostent he;
+	struct lud lud;
+	size_t len;
+	unsigned i;
+	int err, herr;
+
+	if (!mkdtemp(dir)) {
+		fail("users", "mkdtemp");
+		return;
+	}
+	snprintf(path, sizeof path, "%s/passwd", dir);
+	if (make_index(path, "-p", passwd)) {
+		fail("users", "localuser-mkdb -p");
+		return;
+	}
+	get_config();
+	snprintf(config.users, sizeof config.users, "%s.db", path);
+	users_index.next_check = 0;
+	snprintf(path, sizeof path, "%s/apps", dir);
+	make_registry(path, "myapp 42\n");
+	snprintf(config.apps, sizeof config.apps, "%s.db", path);
+	apps_index.next_check = 0;
+
+	for (i = 0 ; i < sizeof names / sizeof *names ; i++)
+		if (decode_name(names[i].name, &lud) != names[i].rc
+		 || (names[i].rc == 1 && (lud.uid != names[i].uid
+				|| (lud.has_appid && lud.appid != names[i].appid))))
+			fail("users decode", names[i].name);
+
+	/* all the spellings are aliases */
+	check_aliases("localuser-bob-myapp", 1002, "localuser--42 localuser-1002-42 "
+		"localuser-bob-42 localuser--myapp localuser-1002-myapp localuser-bob-myapp");
+	check_aliases("localuser-bob-myapp.3", 5, "localuser-1002-42.3 localuser-bob-42.3 "
+		"localuser-1002-myapp.3 localuser-bob-myapp.3");
+	check_aliases("localuser-alice", 1001, "localuser localuser-1001 localuser-alice");
+	check_aliases("localuser---myapp", 1001, "localuser---42 localuser---myapp");
+	check_aliases("localuser-7-8", 7, "localuser--8 localuser-7-8");
+
+	/* the names of the user and of the application are aliases */
+	if (decode_ipv4(htonl(locusr_both_ids_prefix | (42 << locusr_both_ids_appid_shift) | 1002), &lud) != 1
+	 || fillent(&lud, AF_INET, &he, buffer, sizeof buffer, &err, &herr) != NSS_STATUS_SUCCESS
+	 || strcmp(he.h_name, lud.me == 1002 ? "localuser--42" : "localuser-1002-42"))
+		fail("users alias", "localuser-1002-42");
+	else {
+		for (i = 0 ; i < 3 ; i++)
+			if (!he.h_aliases[i] || strcmp(he.h_aliases[i], aliases[i + 1]))
+				fail("users alias", aliases[i + 1]);
+		if (he.h_aliases[3])
+			fail("users alias", "end");
+		len = (size_t)(he.h_aliases[2] - buffer) + strlen(he.h_aliases[2]) + 1;
+		for (i = 0 ; i < len ; i++)
+			if (fillent(&lud, AF_INET, &he, buffer, i, &err, &herr) != NSS_STATUS_TRYAGAIN)
+				fail("users alias", "ERANGE");
+		if (fillent(&lud, AF_INET, &he, buffer, len, &err, &herr) != NSS_STATUS_SUCCESS)
+			fail("users alias", "exact size");
+	}
+	if (index_users(&users_index) || index_users(&apps_index))
+		fail("users", "lookups not ended");
+
+	snprintf(buffer, sizeof buffer, "rm -r %s", dir);
+	if (system(buffer))
+		fail("users", buffer);
+	strcpy(config.users, USERS_FILE);
+	strcpy(config.apps, APPS_FILE);
+	users_index.next_check = apps_index.next_check = 0;
+	index_check(&users_index);
+	index_check(&apps_index);
+}
+
+/* check the translation of the UIDs of a user namespace */
+static void check_uid_map(void)
+{
+	static const struct extent extents[] = {
+		{ 1000, 1001, 1 },
+		{ 0, 100000, 1000 },
+		{ 1001, 101001, 64535 }
+	};
+	static const struct { uint32_t uid, hostuid; int mapped; } uids[] = {
+		{ 0, 100000, 1 },
+		{ 999, 100999, 1 },
+		{ 1000, 1001, 1 },
+		{ 1001, 101001, 1 },
+		{ 65535, 165535, 1 },
+		{ 65536, 0, 0 },
+		{ 4294967294u, 0, 0 }
+	};
+	static const uint32_t unmapped[] = { 0, 1000, 99999, 166000 };
+	struct lud lud;
+	char name[64];
+	uint32_t val;
+	unsigned i;
+	int identity;
+
+	get_config();
+	pthread_once(&uid_map.once, read_uid_map);
+	identity = uid_map.identity;
+	config.host_uid = 1;
+
+	/* a map not yet written maps nothing, not even the overflow UID */
+	uid_map.identity = 0;
+	uid_map.count = 0;
+	if (uid_to_host(65534, &val) || uid_from_host(65534, &val))
+		fail("uid map empty", "65534");
+	if (decode_name("localuser-65534", &lud) != -2)
+		fail("uid map empty forward", "localuser-65534");
+	if (decode_ipv4(htonl(locusr_uid_only_prefix | 65534), &lud) != -1)
+		fail("uid map empty reverse", "127.160.255.254");
+
+	uid_map.count = sizeof extents / sizeof *extents;
+	memcpy(uid_map.byns, extents, sizeof extents);
+	memcpy(uid_map.byhost, extents, sizeof extents);
+	qsort(uid_map.byns, uid_map.count, sizeof *extents, cmp_extent_ns);
+	qsort(uid_map.byhost, uid_map.count, sizeof *extents, cmp_extent_host);
+
+	for (i = 0 ; i < sizeof uids / sizeof *uids ; i++) {
+		snprintf(name, sizeof name, "%u", uids[i].uid);
+		if (uid_to_host(uids[i].uid, &val) != uids[i].mapped
+		 || (uids[i].mapped && (val != uids[i].hostuid
+				|| !uid_from_host(val, &val) || val != uids[i].uid)))
+			fail("uid map", name);
+	}
+	for (i = 0 ; i < sizeof unmapped / sizeof *unmapped ; i++)
+		if (uid_from_host(unmapped[i], &val)) {
+			snprintf(name, sizeof name, "%u", unmapped[i]);
+			fail("uid map unmapped host", name);
+		}
+
+	/* the addresses have the UIDs of the host, the names the ones of the namespace */
+	if (decode_name("localuser-1000-5", &lud) != 1 || lud.uid != 1000 || lud.hostuid != 1001
+	 || lud.ipv4 != htonl(locusr_both_ids_prefix | (5 << locusr_both_ids_appid_shift) | 1001))
+		fail("uid map forward", "localuser-1000-5");
+	if (decode_ipv4(lud.ipv4, &lud) != 1 || lud.uid != 1000 || lud.hostuid != 1001)
+		fail("uid map reverse", "localuser-1000-5");
+	if (decode_name("localuser-65536", &lud) != -2)
+		fail("uid map forward unmapped", "localuser-65536");
+	if (decode_ipv4(htonl(locusr_uid_only_prefix | 1000), &lud) != -1)
+		fail("uid map reverse unmapped", "127.160.3.232");
+
+	uid_map.count = 0;
+	uid_map.identity = identity;
+	config.host_uid = 0;
+}
+
+/* check that the codec of liblocaluser agrees with the module */
+static void check_library(void)
+{
+	struct lud lud;
+	struct localuser_id id, id2;
+	struct in6_addr ip6;
+	uint32_t adr, ipv4;
+	char name[64], name2[LOCALUSER_NAME_SIZE], ip[32];
+	size_t len;
+	int rc;
+
+	for (adr = prefix_value ; (adr & prefix_mask) == prefix_value ; adr += quick ? 97 : 1) {
+		sprintf(ip, "%08x", adr);
+		rc = decode_ipv4(htonl(adr), &lud);
+		if (localuser_decode_ipv4(htonl(adr), &id) != rc)
+			fail("localuser_decode_ipv4", ip);
+		if ((localuser_classify_ipv4(htonl(adr)) == LOCALUSER_KIND_RESERVED) != (rc != 1))
+			fail("localuser_classify_ipv4", ip);
+		if (rc != 1)
+			continue;
+		encode_name(&lud, name);
+		len = localuser_format_name(&id, name2, sizeof name2);
+		if (len != lud.len || strcmp(name, name2))
+			fail("localuser_format_name", ip);
+		if (localuser_parse_name(name, &id2) != 1 || memcmp(&id, &id2, sizeof id))
+			fail("localuser_parse_name", name);
+		if (localuser_encode_ipv4(&id, &ipv4) != 1 || ipv4 != htonl(adr))
+			fail("localuser_encode_ipv4", name);
+		if (localuser_encode_ipv6(&id, &ip6) != 1 || !IN6_IS_ADDR_V4MAPPED(&ip6)
+		 || memcmp(&ip6.s6_addr[12], &ipv4, 4))
+			fail("localuser_encode_ipv6", name);
+		if (localuser_decode_ipv6(&ip6, &id2) != 1 || memcmp(&id, &id2, sizeof id))
+			fail("localuser_decode_ipv6", name);
+	}
+
+	if (localuser_classify_ipv4(htonl(0x7f000001)) != LOCALUSER_KIND_NONE
+	 || localuser_decode_ipv4(htonl(0x7f000001), &id) != 0)
+		fail("localuser_decode_ipv4", "127.0.0.1");
+	if (localuser_parse_name("localhost", &id) != 0
+	 || localuser_parse_name("localuser-x", &id) != -1
+	 || localuser_parse_name("localuser-4294967295", &id) != -2)
+		fail("localuser_parse_name", "status");
+
+	/* truncation as snprintf */
+	id.flags = LOCALUSER_UID | LOCALUSER_APPID;
+	id.uid = 4294967295u;
+	id.appid = 4294967295u;
+	id.replica = 3;
+	if (localuser_format_name(&id, name2, sizeof name2) != sizeof name2 - 1
+	 || strcmp(name2, "localuser-4294967295-4294967295.3"))
+		fail("localuser_format_name", "largest");
+	if (localuser_format_name(&id, name2, 12) != sizeof name2 - 1
+	 || strcmp(name2, "localuser-4"))
+		fail("localuser_format_name", "truncated");
+	if (localuser_encode_ipv4(&id, &ipv4) != -2)
+		fail("localuser_encode_ipv4", "out of range");
+
+	/* invalid identities */
+	id.flags = 0;
+	if (localuser_format_name(&id, name2, sizeof name2) != 0
+	 || localuser_encode_ipv4(&id, &ipv4) != -1)
+		fail("localuser_format_name", "no id");
+	id.flags = LOCALUSER_APPID;
+	id.replica = 1;
+	if (localuser_format_name(&id, name2, sizeof name2) != 0)
+		fail("localuser_format_name", "replica without UID");
+}
+
+/* check the batch resolution with each matcher of prefixes against the codec */
+static void check_batch(void)
+{
+	static const char *const mixed[] = {
+		"localuser", "www.example.com", "localuser-1001-42", "LOCALUSER--7",
+		"localuse", "localusex-5", "localuser-x", "db-1.prod", "localuser---5",
+		"localuser-4294967295", "", "l", "localuser.", "localuser-5-7.2",
+		"Localuser-100000-3", "localhost", "localuser-5.lan", "x",
+		"localuserx", "LOCALUSER", "localuser_5", "localuserr-5", "localuser-5-7.lan."
+	};
+	static const char *const tails[] = { "localuser", "localuse", "lo", "" };
+	static unsigned (*const matchers[])(const char *const *) = {
+		match_prefixes_scalar,
+#if defined __x86_64__ || defined __i386__
+		match_prefixes_sse2,
+#endif
+#if defined __x86_64__
+		match_prefixes_avx2,
+#endif
+	};
+	const char *names[64];
+	uint32_t addrs[64], adr;
+	int status[64], rc;
+	struct localuser_id id;
+	char *page, what[64];
+	size_t count, resolved, i, k;
+	unsigned m;
+
+	/* names ending at the end of a page followed by an unmapped one */
+	page = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED || mprotect(&page[4096], 4096, PROT_NONE)) {
+		fail("mmap", "page");
+		return;
+	}
+	count = 0;
+	for (i = 0 ; i < sizeof mixed / sizeof *mixed ; i++)
+		names[count++] = mixed[i];
+	for (i = 0, k = 4096 ; i < sizeof tails / sizeof *tails ; i++) {
+		k -= strlen(tails[i]) + 1;
+		memcpy(&page[k], tails[i], strlen(tails[i]) + 1);
+		names[count++] = &page[k];
+	}
+
+	for (m = 0 ; m < sizeof matchers / sizeof *matchers ; m++) {
+#if defined __x86_64__
+		if (matchers[m] == match_prefixes_avx2 && !__builtin_cpu_supports("avx2"))
+			continue;
+#endif
+		pthread_once(&match_once, select_match_prefixes);
+		match_prefixes = matchers[m];
+		for (k = 0 ; k <= count ; k++) {
+			resolved = localuser_resolve_names(&names[count - k], k, addrs, status);
+			for (i = 0 ; i < k ; i++) {
+				rc = localuser_parse_name(names[count - k + i], &id);
+				adr = 0;
+				if (rc == 1 && localuser_encode_ipv4(&id, &adr) != 1)
+					rc = -2;
+				if (status[i] != rc || addrs[i] != (rc == 1 ? adr : 0)) {
+					snprintf(what, sizeof what, "%u %s", m, names[count - k + i]);
+					fail("localuser_resolve_names", what);
+				}
+				resolved -= rc == 1;
+			}
+			if (resolved)
+				fail("localuser_resolve_names", "count");
+		}
+	}
+	match_prefixes = match_prefixes_scalar;
+	select_match_prefixes();
+	munmap(page, 8192);
+}
+
+/* check the addresses classified by localuser_classify_ipv4s against decode_ipv4_ids */
+static void check_classified(const uint32_t *addrs, size_t count, const char *what)
+{
+	static uint32_t uids[1024], appids[1024];
+	static uint8_t kinds[1024];
+	struct lud lud;
+	size_t i, valid;
+	char msg[64];
+	int rc;
+
+	valid = localuser_classify_ipv4s(addrs, count, uids, appids, kinds);
+	for (i = 0 ; i < count ; i++) {
+		rc = decode_ipv4_ids(addrs[i], &lud);
+		if (kinds[i] != (rc == 1 ? classify_ipv4(ntohl(addrs[i]))
+				: rc == 0 ? LOCALUSER_KIND_NONE : LOCALUSER_KIND_RESERVED)
+		 || uids[i] != (rc == 1 && lud.has_uid ? lud.uid : 0)
+		 || appids[i] != (rc == 1 && lud.has_appid ? lud.appid : 0)) {
+			snprintf(msg, sizeof msg, "%s %08x", what, ntohl(addrs[i]));
+			fail("localuser_classify_ipv4s", msg);
+		}
+		valid -= rc == 1;
+	}
+	if (valid)
+		fail("localuser_classify_ipv4s count", what);
+}
+
+/* check each classifier of addresses on all the addresses of 127.128.0.0/9 */
+static void check_classify(void)
+{
+	static size_t (*const classifiers[])(const uint32_t *, size_t, uint32_t *,
+					     uint32_t *, uint8_t *, size_t *) = {
+		NULL,
+#if defined __x86_64__ || defined __i386__
+		classify_sse41,
+		classify_avx2,
+#endif
+	};
+	static const char *const names[] = { "scalar", "sse4.1", "avx2" };
+	static const struct extent extents[] = { { 0, 100000, 1000 }, { 1000, 1001, 1 } };
+	uint32_t addrs[1024], adr, seed = 1;
+	unsigned c, i, n;
+	int identity;
+
+	for (c = 0 ; c < sizeof classifiers / sizeof *classifiers ; c++) {
+#if defined __x86_64__ || defined __i386__
+		if (classifiers[c] == classify_avx2 && !__builtin_cpu_supports("avx2"))
+			continue;
+		if (classifiers[c] == classify_sse41 && !__builtin_cpu_supports("sse4.1"))
+			continue;
+#endif
+		pthread_once(&classify_once, select_classify);
+		classify = classifiers[c];
+
+		/* all the addresses of localuser, by blocks of varying sizes */
+		n = 0;
+		for (adr = prefix_value ; (adr & prefix_mask) == prefix_value ; adr += quick ? 61 : 1) {
+			addrs[n++] = htonl(adr);
+			if (n == 1021) {
+				check_classified(addrs, n, names[c]);
+				n = 0;
+			}
+		}
+		check_classified(addrs, n, names[c]);
+
+		/* random addresses, most of them not of localuser */
+		for (i = 0 ; i < 1024 ; i++) {
+			seed = seed * 1103515245 + 12345;
+			addrs[i] = i & 1 ? seed : htonl(0x7f000000 | (seed >> 8));
+		}
+		for (n = 0 ; n <= 17 ; n++)
+			check_classified(addrs, n, names[c]);
+		check_classified(addrs, 1024, names[c]);
+
+		/* other window of subordinated UIDs and UIDs of a namespace */
+		get_config();
+		config.subuid = 200000;
+		config.subuid_appid_bits = 3;
+		for (i = 0 ; i < 1024 ; i++)
+			addrs[i] = htonl(locusr_large_uid_prefix | (i & 1 ? locusr_large_uid_window : 0)
+					 | ((i * 509) & (locusr_large_uid_window - 1)));
+		check_classified(addrs, 1024, names[c]);
+		config.host_uid = 1;
+		pthread_once(&uid_map.once, read_uid_map);
+		identity = uid_map.identity;
+		uid_map.identity = 0;
+		uid_map.count = sizeof extents / sizeof *extents;
+		memcpy(uid_map.byns, extents, sizeof extents);
+		memcpy(uid_map.byhost, extents, sizeof extents);
+		qsort(uid_map.byns, uid_map.count, sizeof *extents, cmp_extent_ns);
+		qsort(uid_map.byhost, uid_map.count, sizeof *extents, cmp_extent_host);
+		for (i = 0 ; i < 1024 ; i++)
+			addrs[i] = htonl(locusr_both_ids_prefix + i * 5);
+		addrs[0] = htonl(locusr_large_uid_prefix | locusr_large_uid_window | (3 << 6) | 5);
+		addrs[1] = htonl(locusr_uid_only_prefix | 100999);
+		addrs[2] = htonl(locusr_uid_only_prefix | 1001);
+		check_classified(addrs, 1024, names[c]);
+		uid_map.count = 0;
+		uid_map.identity = identity;
+		config.host_uid = 0;
+		config.subuid = locusr_large_uid_subuid;
+		config.subuid_appid_bits = locusr_large_uid_appid_bits;
+	}
+	classify = NULL;
+	select_classify();
+}
+
+/* check the output and the exit status of the command tool run with args on the input */
+static void check_tool(const char *tool, const char *args, const char *input,
+		       const char *expected, int status)
+{
+	char path[] = "/tmp/test-codec-tool-XXXXXX", cmd[512], output[1024];
+	size_t len;
+	FILE *file;
+	int fd, rc;
+
+	fd = mkstemp(path);
+	if (fd < 0 || write(fd, input, strlen(input)) != (ssize_t)strlen(input)) {
+		fail(tool, "input");
+		return;
+	}
+	close(fd);
+	snprintf(cmd, sizeof cmd, "./%s %s < %s", tool, args, path);
+	file = popen(cmd, "r");
+	len = file ? fread(output, 1, sizeof output - 1, file) : 0;
+	output[len] = 0;
+	rc = file ? pclose(file) : -1;
+	if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != status || strcmp(output, expected))
+		fail(tool, args);
+	unlink(path);
+}
+
+/*
+ * write in buf the canonical name of the UID uid with the APPID appid
+ * or without APPID if NULL, as given to the current user
+ */
+static const char *canonical(char buf[32], uint32_t uid, const char *appid)
+{
+	if (uid == current_uid())
+		snprintf(buf, 32, appid ? "localuser--%s" : "localuser", appid);
+	else if (appid)
+		snprintf(buf, 32, "localuser-%u-%s", (unsigned)uid, appid);
+	else
+		snprintf(buf, 32, "localuser-%u", (unsigned)uid);
+	return buf;
+}
+
+/* check the commands localuser and localuser-annotate */
+static void check_tools(void)
+{
+	char n1[32], n2[32], n3[32], n4[32], n5[32], n6[32], expected[512];
+
+	canonical(n1, 1001, "42");
+	canonical(n2, 1001, NULL);
+	snprintf(expected, sizeof expected, "127.193.83.233 %s\n127.160.3.233 %s\n"
+		"- foo\n127.176.0.7 localuser---7\n", n1, n2);
+	check_tool("localuser", "-4", "localuser-1001-42\n  127.160.3.233 \nfoo\nlocaluser---7",
+		expected, 2);
+	snprintf(expected, sizeof expected, "127.193.83.233 %s\n127.160.3.233 %s\n", n1, n2);
+	check_tool("localuser", "-4", "localuser-1001-42\n127.160.3.233\n", expected, 0);
+	check_tool("localuser", "-n -6", "localuser-1001-42\n", "::ffff:127.193.83.233\n", 0);
+	check_tool("localuser", "-n", "localuser-1001-42\nlocaluser-x\n", "127.193.83.233\n-\n", 2);
+	snprintf(expected, sizeof expected, "%s\n%s\n%s\n%s\n",
+		canonical(n3, 5, "2046"), canonical(n4, 5, "2047"),
+		canonical(n5, 61184, "63"), canonical(n6, 61185, "63"));
+	check_tool("localuser", "-n -e localuser-5-2046:4000 localuser---7.1 localuser-61184:61185-63:64", "",
+		expected, 0);
+	snprintf(expected, sizeof expected, "from 127.193.83.233(%s):443\nto 127.0.0.1 127.160.3.2334\n"
+		"[::ffff:127.176.0.7(localuser---7)]", n1);
+	check_tool("localuser-annotate", "-j 2", "from 127.193.83.233:443\nto 127.0.0.1 127.160.3.2334\n"
+		"[::ffff:127.176.0.7]", expected, 0);
+	snprintf(expected, sizeof expected, "a=%s, b=%s.\n", n2, n1);
+	check_tool("localuser-annotate", "-r", "a=127.160.3.233, b=::FFFF:127.193.83.233.\n", expected, 0);
+}
+
+/* check that localuser-top accounts a listener of localuser---1048574 */
+static void check_top(void)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	char line[256];
+	FILE *file;
+	int fd, found = 0;
+
+	sin.sin_addr.s_addr = htonl(0x7fbffffe);
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&sin, sizeof sin) || listen(fd, 1)) {
+		fail("localuser-top", "listen");
+		return;
+	}
+	file = popen("./localuser-top -s", "r");
+	while (file && fgets(line, sizeof line, file))
+		found |= !strcmp(line, "localuser---1048574\t-\t1048574\t1\t0\t0\t0\n");
+	if (!file || pclose(file) || !found)
+		fail("localuser-top", "-s");
+	close(fd);
+}
+
+int main(int ac, char **av)
+{
+	quick = ac > 1 && !strcmp(av[1], "-q");
+
+	check_read_u32_reject();
+	check_read_u32_page();
+	check_ipv4_roundtrip();
+	check_authoritative();
+	check_variants();
+	check_large_uid();
+	check_subuid_bits();
+	check_replicas();
+	check_native_ipv6();
+	check_canonname();
+	check_aliases("localuser-1001-42", 1001, "localuser--42 localuser-1001-42");
+	check_aliases("localuser-1001", 1001, "localuser localuser-1001");
+	check_aliases("localuser-1001-42", 5, "localuser-1001-42");
+	check_aliases("localuser---42", 5, "localuser---42");
+	check_aliases("localuser-100000-3", 100000, "localuser--3 localuser-100000-3");
+	check_registry();
+	check_users();
+	check_uid_map();
+	check_library();
+	check_batch();
+	check_classify();
+	check_tools();
+	check_top();
+	if (!quick)
+		check_u32_exhaustive();
+
+	printf("%s: %lu failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+	return !!failures;
+}
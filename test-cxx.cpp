@@ -0,0 +1,207 @@
+/*
+ * Copyright 2018 IoT.bzh <jose.bollo@iot.bzh>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/*
+ * test-cxx.cpp
+ * ------------
+ *  Checks that the header localuser.hpp agrees with the codec of the
+ *  module, given by liblocaluser.
+ *
+ *  usage: test-cxx [-q]
+ *
+ *  The option -q checks only a sample of the addresses.
+ */
+#include "localuser.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/* the constant addresses fold at compile time */
+static_assert(localuser::ipv4_of(localuser::user(1001)) == 0x7fa003e9u);
+static_assert(localuser::ipv4_of(localuser::user_app(1001, 42)) == 0x7fc153e9u);
+static_assert(localuser::ipv4_of(localuser::user_app(5, 7, 2)) == 0x7f980287u);
+static_assert(localuser::ipv4_of(localuser::app(5)) == 0x7fb00005u);
+static_assert(localuser::ipv4_of(localuser::user_app(100000, 3)) == 0x7f880003u);
+static_assert(localuser::ipv4_of(localuser::user(1 << 20)) == 0);
+static_assert(localuser::classify_ipv4(0x7f000001u) == LOCALUSER_KIND_NONE);
+static_assert(localuser::name_of(localuser::user_app(1001, 42), 0).view() == "localuser-1001-42");
+static_assert(localuser::name_of(localuser::user_app(1001, 42, 3), 1001).view() == "localuser--42.3");
+static_assert(localuser::name_of(localuser::app(7), 0).view() == "localuser---7");
+static_assert(localuser::name_of(localuser::user(0), 0).view() == "localuser");
+
+static unsigned long failures;
+static bool quick;
+
+/* report a failure */
+static void fail(const char *what, const char *arg)
+{
+	if (failures++ < 20)
+		printf("FAILED %s: %s\n", what, arg);
+}
+
+/* check the parsing of name by both */
+static void check_parse(const char *name, uint32_t me)
+{
+	localuser_id c = {}, x = {};
+	int rc, rx;
+
+	rc = localuser_parse_name(name, &c);
+	rx = localuser::parse_name(name, me, x);
+	if (rc != rx || (rc == LOCALUSER_OK && memcmp(&c, &x, sizeof c)))
+		fail("parse_name", name);
+}
+
+/* check the encoding of id by both */
+static void check_encode(const localuser_id &id, uint32_t me)
+{
+	char name[LOCALUSER_NAME_SIZE], namex[LOCALUSER_NAME_SIZE];
+	uint32_t adr = 0, adrx = 0;
+	size_t len;
+	int rc, rx;
+
+	rc = localuser_encode_ipv4(&id, &adr);
+	rx = localuser::encode_ipv4(id, adrx);
+	len = localuser_format_name(&id, name, sizeof name);
+	if (rc != rx || (rc == LOCALUSER_OK && adr != localuser::to_network(adrx))
+	 || len != localuser::format_name(id, me, namex, sizeof namex)
+	 || (len && strcmp(name, namex)))
+		fail("encode_ipv4", len ? name : "invalid");
+}
+
+/* check all the addresses of 127.128.0.0/9 */
+static void check_addresses(uint32_t me)
+{
+	localuser_id c = {}, x = {};
+	char name[LOCALUSER_NAME_SIZE], ip[32];
+	uint32_t adr;
+	int rc, rx;
+
+	for (adr = localuser::prefix_value
+	     ; (adr & localuser::prefix_mask) == localuser::prefix_value
+	     ; adr += quick ? 97 : 1) {
+		snprintf(ip, sizeof ip, "%08x", adr);
+		if (localuser_classify_ipv4(htonl(adr)) != localuser::classify_ipv4(adr))
+			fail("classify_ipv4", ip);
+		rc = localuser_decode_ipv4(htonl(adr), &c);
+		rx = localuser::decode_ipv4(adr, x);
+		if (rc != rx || (rc == LOCALUSER_OK && memcmp(&c, &x, sizeof c))) {
+			fail("decode_ipv4", ip);
+			continue;
+		}
+		if (rc != LOCALUSER_OK)
+			continue;
+		if (localuser::ipv4_of(x) != adr)
+			fail("ipv4_of", ip);
+		check_encode(c, me);
+		localuser_format_name(&c, name, sizeof name);
+		check_parse(name, me);
+	}
+}
+
+/* check the identities around the limits of the ranges */
+static void check_identities(uint32_t me)
+{
+	static const uint32_t appids[] = {
+		0, 1, 63, 64, 127, 128, 2047, 2048, 0xfffff, 0x100000, 0xffffffff
+	};
+	uint32_t uid;
+	unsigned i, r;
+
+	for (uid = 0 ; uid < (1u << 21) ; uid += uid < 200000 ? 1 : 61) {
+		check_encode(localuser::user(uid), me);
+		for (i = 0 ; i < sizeof appids / sizeof *appids ; i += quick ? 3 : 1)
+			for (r = 0 ; r <= 3 ; r++)
+				check_encode(localuser::user_app(uid, appids[i], r), me);
+	}
+	for (i = 0 ; i < sizeof appids / sizeof *appids ; i++)
+		check_encode(localuser::app(appids[i]), me);
+	check_encode(localuser::user(0xffffffff), me);
+	check_encode(localuser::user_app(0xffffffff, 0xffffffff, 3), me);
+	check_encode(localuser_id{ 0, 1, 2, 0 }, me);
+	check_encode(localuser_id{ LOCALUSER_APPID, 0, 2, 1 }, me);
+	check_encode(localuser_id{ LOCALUSER_UID, 1, 0, 1 }, me);
+	check_encode(localuser::user_app(1, 2, 4), me);
+}
+
+/* check the window 1 of large UIDs with other bits of APPID */
+static void check_subuid_bits(void)
+{
+	static const std::uint8_t bits[] = { 0, 3, 13 };
+	localuser::identity x = {};
+	char ip[32];
+	uint32_t off, adr;
+	unsigned b;
+
+	for (b = 0 ; b < sizeof bits / sizeof *bits ; b++) {
+		for (off = 0 ; off < localuser::locusr_large_uid_window ; off += quick ? 97 : 1) {
+			adr = localuser::locusr_large_uid_prefix | localuser::locusr_large_uid_window | off;
+			snprintf(ip, sizeof ip, "%08x/%u", adr, bits[b]);
+			if (localuser::decode_ipv4(adr, x, 100000, bits[b]) != LOCALUSER_OK
+			 || x.uid != 100000 + (off >> bits[b])
+			 || x.appid != (off & ((1u << bits[b]) - 1))
+			 || localuser::ipv4_of(x, 100000, bits[b]) != adr)
+				fail("subuid bits", ip);
+		}
+	}
+	if (localuser::parse_name("localuser-165535-7", 0, x, 100000, 3) != LOCALUSER_OK
+	 || localuser::parse_name("localuser-165535-7", 0, x) != LOCALUSER_OUT_OF_RANGE)
+		fail("subuid bits", "localuser-165535-7");
+}
+
+/* check names that aren't canonical or valid */
+static void check_names(uint32_t me)
+{
+	static const char *const names[] = {
+		"localuser", "localuser.", "LocalUser-5", "localuser-", "localuser--",
+		"localuser---", "localuser-5-", "localuser-05", "localuser-0",
+		"localuser-4294967295", "localuser-4294967296", "localuser-99999999999",
+		"localuser-5-7.", "localuser-5-7.4", "localuser-5-7.0", "localuser-5-7.2.",
+		"localuser-5-7.2x", "localuser-5.2", "localuser-5x", "localuser-5.x",
+		"localuser---5.2", "localuser--5.3", "localuser----5", "localuser-+5",
+		"localuser-1048575", "localuser-1048576", "localuser---1048576",
+		"localuser-100000-63", "localuser-100000-64", "localuser-61184-1",
+		"localusers", "localhost", "local", ""
+	};
+	unsigned i;
+
+	for (i = 0 ; i < sizeof names / sizeof *names ; i++)
+		check_parse(names[i], me);
+}
+
+int main(int ac, char **av)
+{
+	uint32_t me = (uint32_t)getuid();
+
+	quick = ac > 1 && !strcmp(av[1], "-q");
+
+	if (localuser::to_network(0x7fc153e9u) != htonl(0x7fc153e9u))
+		fail("to_network", "7fc153e9");
+
+	check_names(me);
+	check_subuid_bits();
+	check_identities(me);
+	check_addresses(me);
+
+	printf("%s: %lu failure(s)\n", failures ? "FAILED" : "PASSED", failures);
+	return !!failures;
+}
@@ -21,7 +21,9 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <netdb.h>
+#include <sys/socket.h>
 
 void dumphostent(char *tag, char *arg, struct hostent *h)
 {
@@ -46,13 +48,35 @@ void dumphostent(char *tag, char *arg, struct hostent *h)
 	printf("\n");
 }
 
+/* check that getaddrinfo with AI_CANONNAME gives the expected name */
+int checkcanonname(char *arg, const char *expected)
+{
+	struct addrinfo hints, *res;
+	int rc, ok;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_flags = AI_CANONNAME;
+	rc = getaddrinfo(arg, NULL, &hints, &res);
+	printf("----------------- canonname %s\n", arg);
+	if (rc) {
+		printf("%s\n\n", gai_strerror(rc));
+		return expected == NULL;
+	}
+	ok = expected && res->ai_canonname && !strcmp(res->ai_canonname, expected);
+	printf("canonname: %s%s\n\n", res->ai_canonname ?: "NULL!", ok ? "" : " MISMATCH!");
+	freeaddrinfo(res);
+	return ok;
+}
+
 int main(int ac, char **av)
 {
 	struct hostent *h;
+	int ok = 1;
 
 	while (*++av) {
 		h = gethostbyname2(*av, AF_INET);
 		dumphostent("name->addr", *av, h);
+		ok &= checkcanonname(*av, h ? h->h_name : NULL);
 
 		if (h) {
 			h = gethostbyaddr(h->h_addr_list[0], h->h_length, h->h_addrtype);
@@ -67,6 +91,6 @@ int main(int ac, char **av)
 			dumphostent("addr->name", *av, h);
 		}
 	}
-	return 0;
+	return !ok;
 }
 